@@ -0,0 +1,185 @@
+/* Measures how long scans of the job table take, depending on whether data
+ * that the scans don't look at is kept in job and process slots or aside.
+ * Layouts mirror 'job_t' and 'proc_t' from jobs.c before and after they were
+ * split into hot and cold parts.
+ *
+ * Usage: ./jobscan [njobs] [nprocs] [repeats]
+ * Every job has 'nprocs' processes. Reported times are per single scan of:
+ * - the whole table by 'pausejob' and 'unpausejob' policies,
+ * - all processes by SIGCHLD handler looking for a buried pid. */
+
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+
+#include "shell.h"
+
+/* Process with resource usage and limits in its slot. */
+typedef struct
+{
+  pid_t pid;
+  int pidfd;
+  int state;
+  int exitcode;
+  struct timespec start, end;
+  struct timeval utime, stime;
+  long maxrss, nvcsw, nivcsw;
+  limits_t limits;
+  bool adopted;
+  size_t argv;
+  int argc;
+} fatproc_t;
+
+/* Cold part of a job, which policies used to reach into. */
+typedef struct
+{
+  struct termios tmodes;
+  char *args, *command, *tokens;
+  size_t argsize, argcap;
+  int gate, nextchunk, nchunks, ntokens;
+  int seq, throttle, throttle_timer, timeout_timer;
+  bool paused, demoted, timed, throttle_stopped, timedout;
+  char ref[64];
+} fatinfo_t;
+
+typedef struct
+{
+  pid_t pgid;
+  int state;
+  int nproc;
+  fatproc_t *proc;
+  fatinfo_t *info;
+} fatjob_t;
+
+/* Process and job slots with only what scans need. */
+typedef struct
+{
+  pid_t pid;
+  int pidfd;
+  int state;
+  int exitcode;
+  bool adopted;
+} proc_t;
+
+typedef struct
+{
+  pid_t pgid;
+  int state;
+  int nproc;
+  int seq;
+  proc_t *proc;
+  void *info;
+  int throttle;
+  int throttle_timer;
+  bool paused;
+  bool demoted;
+} job_t;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile long sink;
+static void *volatile spacer;
+
+/* Cold parts are allocated in between other data, as it happens in shell. */
+static void *coldalloc(size_t size)
+{
+  void *p = calloc(1, size);
+  spacer = malloc(200);
+  return p;
+}
+
+int main(int argc, char **argv)
+{
+  int njobs = argc > 1 ? atoi(argv[1]) : 10000;
+  int nprocs = argc > 2 ? atoi(argv[2]) : 4;
+  int repeats = argc > 3 ? atoi(argv[3]) : 200;
+
+  fatjob_t *fat = calloc(njobs, sizeof(fatjob_t));
+  job_t *hot = calloc(njobs, sizeof(job_t));
+
+  for (int j = 0; j < njobs; j++)
+  {
+    fat[j] = (fatjob_t){.pgid = j + 1, .state = 1, .nproc = nprocs};
+    fat[j].info = coldalloc(sizeof(fatinfo_t));
+    fat[j].info->seq = j;
+    fat[j].proc = calloc(nprocs, sizeof(fatproc_t));
+    hot[j] = (job_t){.pgid = j + 1, .state = 1, .nproc = nprocs, .seq = j};
+    hot[j].info = coldalloc(sizeof(fatinfo_t));
+    hot[j].proc = calloc(nprocs, sizeof(proc_t));
+    for (int p = 0; p < nprocs; p++)
+    {
+      fat[j].proc[p].pid = hot[j].proc[p].pid = j * nprocs + p + 1;
+      fat[j].proc[p].state = hot[j].proc[p].state = 1;
+    }
+  }
+
+  /* Pid that's never found, so every scan goes through whole table. */
+  pid_t pid = -1;
+  double t, tjobfat, tjobhot, tprocfat, tprochot;
+
+  t = now();
+  for (int r = 0; r < repeats; r++)
+  {
+    int youngest = -1;
+    for (int j = 0; j < njobs; j++)
+    {
+      if (!fat[j].pgid || fat[j].state != 1 || fat[j].info->throttle)
+        continue;
+      if (youngest < 0 || fat[j].info->seq > fat[youngest].info->seq)
+        youngest = j;
+    }
+    sink += youngest;
+    for (int j = 0; j < njobs; j++)
+      if (fat[j].pgid && fat[j].info->paused)
+        sink++;
+  }
+  tjobfat = (now() - t) / repeats;
+
+  t = now();
+  for (int r = 0; r < repeats; r++)
+  {
+    int youngest = -1;
+    for (int j = 0; j < njobs; j++)
+    {
+      if (!hot[j].pgid || hot[j].state != 1 || hot[j].throttle)
+        continue;
+      if (youngest < 0 || hot[j].seq > hot[youngest].seq)
+        youngest = j;
+    }
+    sink += youngest;
+    for (int j = 0; j < njobs; j++)
+      if (hot[j].pgid && hot[j].paused)
+        sink++;
+  }
+  tjobhot = (now() - t) / repeats;
+
+  t = now();
+  for (int r = 0; r < repeats; r++)
+    for (int j = 0; j < njobs; j++)
+      for (int p = 0; p < fat[j].nproc; p++)
+        if (fat[j].proc[p].pid == pid)
+          sink++;
+  tprocfat = (now() - t) / repeats;
+
+  t = now();
+  for (int r = 0; r < repeats; r++)
+    for (int j = 0; j < njobs; j++)
+      for (int p = 0; p < hot[j].nproc; p++)
+        if (hot[j].proc[p].pid == pid)
+          sink++;
+  tprochot = (now() - t) / repeats;
+
+  printf("%d jobs, %d processes each\n", njobs, nprocs);
+  printf("job slot %zu (+%zu aside) -> %zu bytes, "
+         "policy scan %.1f -> %.1f us\n",
+         sizeof(fatjob_t), sizeof(fatinfo_t), sizeof(job_t), tjobfat * 1e6,
+         tjobhot * 1e6);
+  printf("proc slot %zu -> %zu bytes, SIGCHLD scan %.1f -> %.1f us\n",
+         sizeof(fatproc_t), sizeof(proc_t), tprocfat * 1e6, tprochot * 1e6);
+  return 0;
+}
@@ -0,0 +1,157 @@
+/* Measures latency of starting an external command as the parent process
+ * grows, comparing fork & execve by the parent with a request to a zygote,
+ * which was forked while the parent was small. Zygote here follows the
+ * protocol of zygote.c: SOCK_SEQPACKET request with words of the command and
+ * descriptors attached, child created with CLONE_PARENT, reply with its pid.
+ *
+ * Usage: ./spawn [command] [repeats] [MiB...]
+ * For each size the parent touches that much heap memory first, so its page
+ * tables have to be copied by fork. Default command is /bin/true. */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "shell.h"
+
+#define MAXSPAWN 4096
+#define NSPAWNFDS 4 /* stdin, stdout, stderr, working directory */
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static noreturn void zygote(int sock)
+{
+  char buf[MAXSPAWN];
+
+  while (true)
+  {
+    union
+    {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int) * NSPAWNFDS)];
+    } cmsg;
+    struct iovec iov = {.iov_base = buf, .iov_len = MAXSPAWN};
+    struct msghdr mh = {.msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = &cmsg,
+                        .msg_controllen = sizeof(cmsg)};
+
+    ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+      exit(EXIT_SUCCESS);
+
+    int fds[NSPAWNFDS];
+    memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&mh)), sizeof(fds));
+
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0)
+    {
+      for (int i = 0; i < 3; i++)
+        dup2(fds[i], i);
+      if (fchdir(fds[3]) < 0)
+        exit(EXIT_FAILURE);
+      char *argv[] = {buf, NULL};
+      execve(buf, argv, environ);
+      exit(127);
+    }
+
+    for (int i = 0; i < NSPAWNFDS; i++)
+      close(fds[i]);
+    (void)send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+  }
+}
+
+static pid_t spawn(int sock, const char *path)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * NSPAWNFDS)];
+  } cmsg;
+  struct iovec iov = {.iov_base = (void *)path, .iov_len = strlen(path) + 1};
+  struct msghdr mh = {.msg_iov = &iov,
+                      .msg_iovlen = 1,
+                      .msg_control = &cmsg,
+                      .msg_controllen = sizeof(cmsg)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * NSPAWNFDS);
+
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  int fds[NSPAWNFDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+  pid_t pid = -1;
+  if (sendmsg(sock, &mh, MSG_NOSIGNAL) > 0)
+    (void)recv(sock, &pid, sizeof(pid), 0);
+  close(cwd);
+  return pid;
+}
+
+static pid_t forkexec(const char *path)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    char *argv[] = {(char *)path, NULL};
+    execve(path, argv, environ);
+    exit(127);
+  }
+  return pid;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = argc > 1 ? argv[1] : "/bin/true";
+  int repeats = argc > 2 ? atoi(argv[2]) : 200;
+  static const char *defsizes[] = {"0", "16", "64", "256", "1024"};
+  const char **sizes = argc > 3 ? (const char **)argv + 3 : defsizes;
+  int nsizes = argc > 3 ? argc - 3 : 5;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    return 1;
+  if (fork() == 0)
+  {
+    close(sv[0]);
+    zygote(sv[1]);
+  }
+  close(sv[1]);
+
+  printf("%8s  %12s  %12s\n", "RSS MiB", "fork us", "zygote us");
+
+  size_t grown = 0;
+  for (int s = 0; s < nsizes; s++)
+  {
+    size_t size = (size_t)atol(sizes[s]) << 20;
+    if (size > grown)
+    {
+      /* Many small blocks, so they come from the heap like shell's data. */
+      for (; grown < size; grown += 4096)
+        memset(malloc(4096 - 16), 1, 4096 - 16);
+    }
+
+    double t = now();
+    for (int r = 0; r < repeats; r++)
+      waitpid(forkexec(path), NULL, 0);
+    double tfork = (now() - t) / repeats;
+
+    t = now();
+    for (int r = 0; r < repeats; r++)
+      waitpid(spawn(sv[0], path), NULL, 0);
+    double tzygote = (now() - t) / repeats;
+
+    printf("%8zu  %12.1f  %12.1f%s\n", grown >> 20, tfork * 1e6,
+           tzygote * 1e6, tzygote < tfork ? "  zygote" : "");
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "shell.h"
+#include "rio.h"
 
 typedef int (*func_t)(char **argv);
 
@@ -8,9 +9,18 @@ typedef struct
   func_t func;
 } command_t;
 
+/*
+ * Exit the shell. Remaining jobs are terminated and killed if they do not
+ * finish in time.
+ * 'quit' - give the jobs default grace period
+ * 'quit seconds' - give the jobs that much time
+ */
 static int do_quit(char **argv)
 {
-  shutdownjobs();
+  long grace = SHUTDOWN_GRACE;
+  if (argv[0])
+    grace = atof(argv[0]) * 1000;
+  shutdownjobs(grace);
   exit(EXIT_SUCCESS);
 }
 
@@ -35,25 +45,51 @@ static int do_chdir(char **argv)
 
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -l' - also show state and resource usage of each process
+ * 'jobs -p' - show process group identifiers only
+ * 'jobs --json' - show state of jobs and their processes as JSON
  */
 static int do_jobs(char **argv)
 {
-  watchjobs(ALL);
+  int format = JOBS_SHORT;
+  if (argv[0] && !strcmp(argv[0], "-l"))
+    format = JOBS_LONG;
+  else if (argv[0] && !strcmp(argv[0], "-p"))
+    format = JOBS_PGIDS;
+  else if (argv[0] && !strcmp(argv[0], "--json"))
+    format = JOBS_JSON;
+  else if (argv[0])
+  {
+    msg("jobs: usage: jobs [-l|-p|--json]\n");
+    return 2;
+  }
+  watchjobs(ALL, format);
   return 0;
 }
 
+/* Job is referred to as '%spec' (see 'findjob') or just by its number.
+ * Returns -1 if there's no such job. */
+static int jobspec(const char *arg)
+{
+  if (*arg == '%')
+    return findjob(arg + 1);
+  return isdigit(*arg) ? findjob(arg) : -1;
+}
+
 /*
  * Move running or stopped background job to foreground.
- * 'fg' choose highest numbered job
- * 'fg n' choose job number n
+ * 'fg' choose current job
+ * 'fg n' or 'fg %n' choose job number n
+ * 'fg %+' or 'fg %-' choose current or previous job
+ * 'fg %prefix' or 'fg %?substring' choose job by its command
  */
 static int do_fg(char **argv)
 {
-  int j = argv[0] ? atoi(argv[0]) : -1;
+  int j = argv[0] ? jobspec(argv[0]) : -1;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, FG, &mask))
+  if ((argv[0] && j < 0) || !resumejob(j, FG, &mask))
     msg("fg: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
@@ -61,25 +97,25 @@ static int do_fg(char **argv)
 
 /*
  * Make stopped background job running.
- * 'bg' choose highest numbered job
- * 'bg n' choose job number n
+ * 'bg' choose current job
+ * 'bg n' or 'bg %spec' choose job as 'fg' does
  */
 static int do_bg(char **argv)
 {
-  int j = argv[0] ? atoi(argv[0]) : -1;
+  int j = argv[0] ? jobspec(argv[0]) : -1;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask))
+  if ((argv[0] && j < 0) || !resumejob(j, BG, &mask))
     msg("bg: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
 /*
- * Make stopped background job running.
- * 'bg' choose highest numbered job
- * 'bg n' choose job number n
+ * Terminate background job.
+ * 'kill %spec' choose job as 'fg' does
+ * Without a job spec external kill command gets run.
  */
 static int do_kill(char **argv)
 {
@@ -88,41 +124,675 @@ static int do_kill(char **argv)
   if (*argv[0] != '%')
     return -1;
 
-  int j = atoi(argv[0] + 1);
+  int j = jobspec(argv[0]);
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!killjob(j))
+  if (j < 0 || !killjob(j))
     msg("kill: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   return 0;
 }
 
-static command_t builtins[] = {
-    {"quit", do_quit},
-    {"cd", do_chdir},
-    {"jobs", do_jobs},
-    {"fg", do_fg},
-    {"bg", do_bg},
-    {"kill", do_kill},
-    {NULL, NULL},
-};
+/* Number of bytes that 'n' strings from 'argv' take up in new process image. */
+static size_t argsize(char **argv, int n)
+{
+  size_t size = 0;
+  for (int i = 0; i < n; i++)
+    size += strlen(argv[i]) + 1 + sizeof(char *);
+  return size;
+}
 
-int builtin_command(char **argv)
+/* Words of a batch job, which starts chunks after 'do_batch' returns if it
+ * gets put in the background. Kept in a single block owned by the job. */
+typedef struct
 {
-  for (command_t *cmd = builtins; cmd->name; cmd++)
+  int nfixed;  /* number of words put in front of each chunk */
+  int *chunk;  /* chunk[c] is index of first argument of chunk c */
+  char **argv; /* fixed words followed by arguments */
+} batch_t;
+
+static batch_t *mkbatch(char **argv, int nfixed, char **args, int nargs,
+                        const int *chunk, int nchunks)
+{
+  int nwords = nfixed + nargs;
+  size_t size = sizeof(batch_t) + sizeof(char *) * nwords +
+                sizeof(int) * (nchunks + 1);
+  for (int i = 0; i < nwords; i++)
+    size += strlen(i < nfixed ? argv[i] : args[i - nfixed]) + 1;
+
+  batch_t *batch = malloc(size);
+  batch->nfixed = nfixed;
+  batch->argv = (char **)(batch + 1);
+  batch->chunk = (int *)(batch->argv + nwords);
+  memcpy(batch->chunk, chunk, sizeof(int) * (nchunks + 1));
+
+  char *text = (char *)(batch->chunk + nchunks + 1);
+  for (int i = 0; i < nwords; i++)
   {
-    if (strcmp(argv[0], cmd->name))
+    const char *word = i < nfixed ? argv[i] : args[i - nfixed];
+    batch->argv[i] = strcpy(text, word);
+    text += strlen(word) + 1;
+  }
+  return batch;
+}
+
+/* Fork process that runs chunk 'k' of a batch in process group 'pgid'. */
+static pid_t forkchunk(pid_t pgid, int k, void *arg)
+{
+  batch_t *batch = arg;
+  pid_t pid = Fork();
+
+  if (pid == 0)
+  {
+    /* Chunk may be started while the shell waits with SIGCHLD blocked. */
+    Sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+    joinjob(pgid, FG);
+    defaultsignals();
+
+    int nfixed = batch->nfixed, *chunk = batch->chunk;
+    int n = chunk[k + 1] - chunk[k];
+    char **cargv = malloc(sizeof(char *) * (nfixed + n + 1));
+    memcpy(cargv, batch->argv, sizeof(char *) * nfixed);
+    memcpy(cargv + nfixed, batch->argv + nfixed + chunk[k],
+           sizeof(char *) * n);
+    cargv[nfixed + n] = NULL;
+    external_command(cargv);
+  }
+
+  /* Parent also moves the child, which may have called execve already. */
+  if (jobcontrol_p())
+    (void)setpgid(pid, pgid);
+  return pid;
+}
+
+/*
+ * Run a command with arguments split into chunks that fit under ARG_MAX.
+ * 'batch cmd args...' - run 'cmd' for consecutive chunks of 'args'
+ * 'batch cmd init-args -- args...' - put 'init-args' in front of each chunk
+ * 'batch -j n ...' - run at most n chunks at once
+ * Exit code is 123 if any chunk fails, as with xargs(1).
+ */
+static int do_batch(char **argv)
+{
+  int nparallel = 1;
+
+  if (argv[0] && !strcmp(argv[0], "-j"))
+  {
+    if (!argv[1] || (nparallel = atoi(argv[1])) < 1)
+    {
+      msg("batch: invalid number of parallel chunks: %s\n",
+          argv[1] ? argv[1] : "");
+      return 1;
+    }
+    argv += 2;
+  }
+
+  if (!argv[0])
+  {
+    msg("batch: command not given\n");
+    return 1;
+  }
+
+  int nfixed = 1, nargs = 0;
+  while (argv[nfixed] && strcmp(argv[nfixed], "--"))
+    nfixed++;
+
+  char **args = argv + nfixed + 1;
+  if (!argv[nfixed])
+  {
+    nfixed = 1;
+    args = argv + 1;
+  }
+  while (args[nargs])
+    nargs++;
+
+  /* Kernel counts both arguments and environment against ARG_MAX.
+   * Leave some headroom as 'external_command' prepends PATH entries. */
+  int nenv = 0;
+  while (environ[nenv])
+    nenv++;
+  long budget = sysconf(_SC_ARG_MAX) - (long)argsize(environ, nenv) -
+                (long)argsize(argv, nfixed) - 2 * sizeof(char *) - 2048;
+  long maxstrlen = 32 * sysconf(_SC_PAGESIZE);
+
+  /* chunk[c] is index of first argument of chunk c, chunk[nchunks] = nargs */
+  int nchunks = 1;
+  int *chunk = malloc(sizeof(int) * (nargs + 2));
+  chunk[0] = 0;
+
+  for (long i = 0, used = 0; i < nargs; i++)
+  {
+    long size = argsize(&args[i], 1);
+    if (size > budget || size > maxstrlen)
+    {
+      msg("batch: argument too long: %.32s...\n", args[i]);
+      free(chunk);
+      return 1;
+    }
+    if (used + size > budget)
+    {
+      chunk[nchunks++] = i;
+      used = 0;
+    }
+    used += size;
+  }
+  chunk[nchunks] = nargs;
+
+  batch_t *batch = mkbatch(argv, nfixed, args, nargs, chunk, nchunks);
+  free(chunk);
+
+  /* Leader holds the process group, so it's there for chunks started later.
+   * It waits until the job closes the pipe. */
+  int gate[2];
+  Pipe(gate);
+  fcntl(gate[0], F_SETFD, FD_CLOEXEC);
+  fcntl(gate[1], F_SETFD, FD_CLOEXEC);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  fflush(stdout);
+  pid_t pgid = Fork();
+  if (pgid == 0)
+  {
+    /* Leader doesn't execve, so it drops shell's handlers to get killed
+     * along with the chunks. */
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGQUIT, SIG_DFL);
+    Signal(SIGTERM, SIG_DFL);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    joinjob(0, FG);
+    defaultsignals();
+    Close(gate[1]);
+    char c;
+    (void)read(gate[0], &c, 1);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (jobcontrol_p())
+    Setpgid(pgid, pgid);
+  Close(gate[0]);
+
+  char *label[] = {"batch", argv[0], "...", NULL};
+  int j = addjob(pgid, FG);
+  addproc(j, pgid, label);
+
+  /* Chunks beyond the first one run on jobserver tokens, if there's one.
+   * Take as many as are available right now, but no more than needed. */
+  char *tokens = malloc(nparallel);
+  int ntokens = 0;
+  if (jobserver_p())
+  {
+    while (ntokens < min(nparallel, nchunks) - 1 &&
+           gettoken(&tokens[ntokens], false) > 0)
+      ntokens++;
+    nparallel = ntokens + 1;
+  }
+  tokenjob(j, tokens, ntokens);
+  free(tokens);
+
+  gatejob(j, gate[1], nchunks, nparallel, forkchunk, batch);
+
+  int exitcode = monitorjob(&mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return exitcode;
+}
+
+/* Build command line from 'argv' words with '{}' replaced by 'arg'.
+ * If there's no '{}' then 'arg' is appended at the end. */
+static char *mkcmdline(char **argv, const char *arg)
+{
+  char *cmdline = NULL;
+  bool used = false;
+
+  for (; *argv; argv++)
+  {
+    if (cmdline)
+      strapp(&cmdline, " ");
+    if (strcmp(*argv, "{}"))
+    {
+      strapp(&cmdline, *argv);
+    }
+    else
+    {
+      strapp(&cmdline, arg);
+      used = true;
+    }
+  }
+
+  if (!cmdline)
+    return strdup(arg);
+  if (!used)
+  {
+    strapp(&cmdline, " ");
+    strapp(&cmdline, arg);
+  }
+  return cmdline;
+}
+
+/* Exit code of 'parallel' is the number of failed jobs, capped at 101 just
+ * like GNU parallel does, as higher codes mean something else. */
+#define PARALLEL_MAXFAILED 101
+
+typedef struct
+{
+  int job;       /* background job index */
+  char *cmdline; /* command line the job was started with */
+} slot_t;
+
+/* Sleep until one of jobs in 'slot' finishes. Report it if it failed,
+ * free its slot and return the number of slots still in use. */
+static int parallel_wait(slot_t *slot, int nslots, int *failedp, sigset_t *mask)
+{
+  while (true)
+  {
+    for (int i = 0; i < nslots; i++)
+    {
+      int status;
+      if (jobstate(slot[i].job, &status) != FINISHED)
+        continue;
+
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+      {
+        if (WIFEXITED(status))
+          msg("parallel: '%s' exitcode: %d\n", slot[i].cmdline,
+              WEXITSTATUS(status));
+        else
+          msg("parallel: '%s' signal: %d\n", slot[i].cmdline,
+              WTERMSIG(status));
+        (*failedp)++;
+      }
+
+      free(slot[i].cmdline);
+      slot[i] = slot[--nslots];
+      return nslots;
+    }
+
+    int js[nslots];
+    for (int i = 0; i < nslots; i++)
+      js[i] = slot[i].job;
+    waitjobs(js, nslots, mask);
+  }
+}
+
+/*
+ * Run many commands as background jobs, but at most n of them at once.
+ * 'parallel [-j n]' - read command lines from standard input
+ * 'parallel [-j n] cmd args...' - read arguments for 'cmd' from standard input
+ * 'parallel [-j n] cmd args... ::: arg...' - take arguments from command line
+ * Argument replaces '{}' word of the command or gets appended to it.
+ * Exit code is the number of failed jobs, see 'PARALLEL_MAXFAILED'.
+ */
+static int do_parallel(char **argv)
+{
+  int nparallel = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (argv[0] && !strcmp(argv[0], "-j"))
+  {
+    if (!argv[1] || (nparallel = atoi(argv[1])) < 1)
+    {
+      msg("parallel: invalid number of jobs: %s\n", argv[1] ? argv[1] : "");
+      return 1;
+    }
+    argv += 2;
+  }
+
+  char **args = NULL;
+  for (int i = 0; argv[i]; i++)
+  {
+    if (!strcmp(argv[i], ":::"))
+    {
+      argv[i] = NULL;
+      args = &argv[i + 1];
+      break;
+    }
+  }
+
+  /* Jobs must not read away lines that are still to come, so they get
+   * /dev/null as standard input, while lines are read from a duplicate. */
+  rio_t rio;
+  char line[RIO_BUFSIZE];
+  int saved_input = -1;
+  if (!args)
+  {
+    saved_input = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    rio_readinitb(&rio, saved_input);
+    int null = Open("/dev/null", O_RDONLY, 0);
+    Dup2(null, STDIN_FILENO);
+    Close(null);
+  }
+
+  slot_t *slot = malloc(sizeof(slot_t) * nparallel);
+  int nslots = 0, njobs = 0, failed = 0;
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  while (true)
+  {
+    const char *arg;
+
+    if (args)
+    {
+      if (!(arg = *args++))
+        break;
+    }
+    else
+    {
+      ssize_t n = rio_readlineb(&rio, line, sizeof(line));
+      if (n <= 0)
+        break;
+      if (n == sizeof(line) - 1 && line[n - 1] != '\n')
+      {
+        msg("parallel: line too long: %.32s...\n", line);
+        while ((n = rio_readlineb(&rio, line, sizeof(line))) > 0 &&
+               line[n - 1] != '\n')
+          continue;
+        failed++;
+        njobs++;
+        continue;
+      }
+      if (line[n - 1] == '\n')
+        line[n - 1] = '\0';
+      if (!*line)
+        continue;
+      arg = line;
+    }
+
+    if (nslots == nparallel)
+      nslots = parallel_wait(slot, nslots, &failed, &mask);
+
+    /* 'eval' tokenizes command line in place, so keep a copy for reports. */
+    char *cmdline = mkcmdline(argv, arg);
+    slot[nslots].cmdline = strdup(cmdline);
+    /* Jobs inherit signal mask that 'eval' starts with. Finished job stays
+     * in its slot until 'parallel_wait' collects it. */
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    eval(cmdline, true);
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+    free(cmdline);
+
+    if ((slot[nslots].job = lastjob()) < 0)
+    {
+      free(slot[nslots].cmdline);
       continue;
-    return cmd->func(&argv[1]);
+    }
+    nslots++;
+    njobs++;
   }
 
-  errno = ENOENT;
-  return -1;
+  while (nslots > 0)
+    nslots = parallel_wait(slot, nslots, &failed, &mask);
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  free(slot);
+
+  if (saved_input >= 0)
+  {
+    Dup2(saved_input, STDIN_FILENO);
+    Close(saved_input);
+  }
+
+  if (failed)
+    msg("parallel: %d of %d jobs failed\n", failed, njobs);
+  return min(failed, PARALLEL_MAXFAILED);
 }
 
-noreturn void external_command(char **argv)
+/*
+ * Share concurrency budget with GNU make through a jobserver.
+ * 'jobserver' - tell whether background jobs need jobserver tokens
+ * 'jobserver n' - become jobserver with n slots and advertise it in MAKEFLAGS
+ */
+static int do_jobserver(char **argv)
+{
+  if (!argv[0])
+  {
+    if (jobserver_p())
+      printf("jobserver: %s\n", getenv("MAKEFLAGS"));
+    else
+      printf("jobserver: none\n");
+    return 0;
+  }
+
+  int n = atoi(argv[0]);
+  if (n < 1)
+  {
+    msg("jobserver: invalid number of slots: %s\n", argv[0]);
+    return 1;
+  }
+  mkjobserver(n);
+  return 0;
+}
+
+/*
+ * Hold back background jobs when system is under pressure (see PSI).
+ * 'pressure' - show pressure of resources and configured limits
+ * 'pressure [-s] cpu=n memory=n io=n' - do not start background jobs while
+ *   share of time stalled on a resource exceeds n percent; with '-s' also
+ *   stop youngest background jobs until the pressure drops
+ * 'pressure off' - remove all limits
+ */
+static int do_pressure(char **argv)
+{
+  if (!argv[0])
+  {
+    showpressure();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "off"))
+  {
+    setpressure("cpu", 0);
+    setpressure("memory", 0);
+    setpressure("io", 0);
+    return 0;
+  }
+
+  bool pause = false;
+  if (!strcmp(argv[0], "-s"))
+  {
+    pause = true;
+    argv++;
+  }
+
+  for (; *argv; argv++)
+  {
+    char *value = index(*argv, '=');
+    if (value)
+      *value++ = '\0';
+    if (!value || !setpressure(*argv, atof(value)))
+    {
+      msg("pressure: invalid limit: %s\n", *argv);
+      return 1;
+    }
+  }
+
+  pausepressure(pause);
+  return 0;
+}
+
+/*
+ * Lower priority of background jobs while a foreground job runs.
+ * 'bgnice' - show the policy
+ * 'bgnice [-i] n' - raise nice value of background jobs by n; with '-i'
+ *   also move them to idle I/O scheduling class
+ * 'bgnice off' - leave priorities of background jobs alone
+ */
+static int do_bgnice(char **argv)
+{
+  if (!argv[0])
+  {
+    showbgnice();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "off"))
+  {
+    setbgnice(0, false);
+    return 0;
+  }
+
+  bool idleio = false;
+  if (!strcmp(argv[0], "-i"))
+  {
+    idleio = true;
+    argv++;
+  }
+
+  int incr = argv[0] ? atoi(argv[0]) : 0;
+  if (incr < 0 || incr > 39)
+  {
+    msg("bgnice: invalid nice increment: %s\n", argv[0]);
+    return 1;
+  }
+
+  setbgnice(incr, idleio);
+  return 0;
+}
+
+/*
+ * Cap CPU share of a background job by stopping and continuing it.
+ * 'throttle %n p%' - let job n run only p percent of the time
+ * 'throttle %n off' - let job n run freely again
+ */
+static int do_throttle(char **argv)
+{
+  if (!argv[0] || *argv[0] != '%' || !argv[1])
+  {
+    msg("throttle: usage: throttle %%n percent|off\n");
+    return 1;
+  }
+
+  int j = jobspec(argv[0]);
+  int percent = strcmp(argv[1], "off") ? atoi(argv[1]) : 0;
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  bool found = j >= 0 && throttlejob(j, percent);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (!found)
+  {
+    msg("throttle: job not found: %s\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Keep track of processes that escape their jobs by daemonizing.
+ * 'subreaper' - tell whether the mode is on
+ * 'subreaper on|off' - adopt orphaned descendants of jobs or not
+ */
+static int do_subreaper(char **argv)
+{
+  if (!argv[0])
+    printf("subreaper: %s\n", subreaper_p() ? "on" : "off");
+  else if (!strcmp(argv[0], "on") || !strcmp(argv[0], "off"))
+    subreaperjobs(!strcmp(argv[0], "on"));
+  else
+  {
+    msg("subreaper: usage: subreaper [on|off]\n");
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Wait for background jobs to finish. Jobs waited for are not reported.
+ * 'wait' - wait for all jobs
+ * 'wait %n' - wait for job n and return its exit code
+ * 'wait -n' - wait for any job and return its exit code
+ */
+static int do_wait(char **argv)
+{
+  int j = -1, status = 0;
+  bool all = !argv[0];
+
+  if (argv[0] && *argv[0] == '%')
+  {
+    if ((j = jobspec(argv[0])) < 0)
+    {
+      msg("wait: no running job: %s\n", argv[0]);
+      return 127;
+    }
+  }
+  else if (argv[0] && strcmp(argv[0], "-n"))
+  {
+    msg("wait: usage: wait [%%n|-n]\n");
+    return 2;
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  int found = waitjob(j, &status, &mask);
+  while (all && found >= 0)
+    found = waitjob(j, &status, &mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (all)
+    return 0;
+  if (found < 0)
+  {
+    if (j >= 0)
+      msg("wait: no running job: %s\n", argv[0]);
+    return 127;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Manage coprocesses started with 'coproc NAME command'.
+ * 'coproc' - list coprocesses
+ * 'coproc -c NAME' - close shell's end of coprocess socket
+ */
+static int do_coproc(char **argv)
+{
+  if (!argv[0])
+  {
+    showcoprocs();
+    return 0;
+  }
+  if (strcmp(argv[0], "-c") || !argv[1] || argv[2])
+  {
+    msg("coproc: usage: coproc [-c NAME | NAME command]\n");
+    return 2;
+  }
+  if (!closecoproc(argv[1]))
+  {
+    msg("coproc: %s: no such coprocess\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Run commands from a file within the current shell.
+ * 'source file' - returns exit code of the last command
+ */
+static int do_source(char **argv)
+{
+  if (!argv[0])
+  {
+    msg("source: usage: source file\n");
+    return 2;
+  }
+  int fd = open(argv[0], O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    msg("source: %s: %s\n", argv[0], strerror(errno));
+    return 1;
+  }
+  int exitcode = runscript(fd, false);
+  Close(fd);
+  return exitcode;
+}
+
+/* Execve the command, looking it up in PATH unless it has a slash. Returns
+ * only if that fails, with errno set. */
+static void trycommand(char **argv)
 {
   const char *path = getenv("PATH");
 
@@ -144,6 +814,8 @@ noreturn void external_command(char **argv)
       argv[0] = (char *)path_directory;                 // wkladamy do argumentu wskaznik na sciezke absolutna do pliku
 
       (void)execve(argv[0], argv, environ); // uruchamiam program z arguementu do programu
+      if (errno == ENOEXEC)
+        runfile(argv[0]);
 
       argv[0] = (char *)executable_name_copy; // do argumentu wkladam to co bylo tam wczesniej
       free(path_directory);                   // zwalniam miejsce zajmowane przez zmienna pomocnicza (czyszcząc jej zawartosc)
@@ -157,8 +829,82 @@ noreturn void external_command(char **argv)
   else
   {
     (void)execve(argv[0], argv, environ);
+    /* No '#!' line, so it's a script for us. */
+    if (errno == ENOEXEC)
+      runfile(argv[0]);
+  }
+}
+
+/*
+ * Replace the shell with a command, or redirect shell's own descriptors.
+ * 'exec command args...' - run the command in place of the shell
+ * 'exec < in > out' - keep the redirections for subsequent commands
+ */
+static int do_exec(char **argv)
+{
+  if (!argv[0])
+  {
+    keepredir();
+    return 0;
+  }
+  fflush(stdout);
+  defaultsignals();
+  if (!jobcontrol_p())
+    external_command(argv);
+
+  /* Interactive shell outlives a command it could not run. */
+  trycommand(argv);
+  msg("exec: %s: %s\n", argv[0], strerror(errno));
+  ignorestops();
+  return 127;
+}
+
+static command_t builtins[] = {
+    {"quit", do_quit},
+    {"cd", do_chdir},
+    {"jobs", do_jobs},
+    {"fg", do_fg},
+    {"bg", do_bg},
+    {"kill", do_kill},
+    {"batch", do_batch},
+    {"parallel", do_parallel},
+    {"jobserver", do_jobserver},
+    {"pressure", do_pressure},
+    {"bgnice", do_bgnice},
+    {"throttle", do_throttle},
+    {"subreaper", do_subreaper},
+    {"wait", do_wait},
+    {"coproc", do_coproc},
+    {"source", do_source},
+    {"exec", do_exec},
+    {NULL, NULL},
+};
+
+int builtin_command(char **argv)
+{
+  for (command_t *cmd = builtins; cmd->name; cmd++)
+  {
+    if (strcmp(argv[0], cmd->name))
+      continue;
+    return cmd->func(&argv[1]);
   }
 
+  errno = ENOENT;
+  return -1;
+}
+
+bool builtin_p(const char *name)
+{
+  for (command_t *cmd = builtins; cmd->name; cmd++)
+    if (!strcmp(name, cmd->name))
+      return true;
+  return false;
+}
+
+noreturn void external_command(char **argv)
+{
+  tagproc();
+  trycommand(argv);
   msg("%s: %s\n", argv[0], strerror(errno));
   exit(EXIT_FAILURE);
 }
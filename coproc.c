@@ -0,0 +1,94 @@
+#include <sys/socket.h>
+
+#include "shell.h"
+
+/* Coprocess is a background job whose standard input and output are both
+ * connected to one end of a socket pair. Shell keeps the other end under
+ * a name, so later commands talk to the job with '>&NAME' and '<&NAME'. */
+
+typedef struct
+{
+  char *name; /* identifier given to 'coproc' */
+  int fd;     /* shell's end of the socket pair */
+} coproc_t;
+
+static coproc_t *coprocs = NULL; /* array of coprocesses */
+static int ncoprocs = 0;         /* number of coprocesses */
+
+static coproc_t *findcoproc(const char *name)
+{
+  for (int i = 0; i < ncoprocs; i++)
+    if (!strcmp(coprocs[i].name, name))
+      return &coprocs[i];
+  return NULL;
+}
+
+/* Names are identifiers, so they cannot be mistaken for options. */
+bool coprocname_p(const char *name)
+{
+  if (!isalpha(*name) && *name != '_')
+    return false;
+  while (isalnum(*name) || *name == '_')
+    name++;
+  return *name == '\0';
+}
+
+bool coproc_p(const char *name)
+{
+  return findcoproc(name) != NULL;
+}
+
+/* Create a socket pair for coprocess 'name', replacing the one that had
+ * the same name. Returns the end to be passed to the job. Both ends are
+ * close-on-exec, so other jobs never hold them and keep the peer from
+ * seeing end of file. */
+int mkcoproc(const char *name)
+{
+  int sv[2];
+  Socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+
+  closecoproc(name);
+  coprocs = realloc(coprocs, sizeof(coproc_t) * (ncoprocs + 1));
+  coprocs[ncoprocs++] = (coproc_t){.name = strdup(name), .fd = sv[0]};
+  return sv[1];
+}
+
+/* Returns a close-on-exec duplicate of shell's end of coprocess socket,
+ * or -1 if there's no such coprocess. */
+int coprocfd(const char *name)
+{
+  coproc_t *cp = findcoproc(name);
+  if (!cp)
+    return -1;
+  int fd = fcntl(cp->fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+    unix_error("fcntl error");
+  return fd;
+}
+
+/* Close shell's end of the socket, so the coprocess reads end of file once
+ * no command uses it. Returns false if there's no such coprocess. */
+bool closecoproc(const char *name)
+{
+  coproc_t *cp = findcoproc(name);
+  if (!cp)
+    return false;
+  Close(cp->fd);
+  free(cp->name);
+  *cp = coprocs[--ncoprocs];
+  return true;
+}
+
+/* Close all coprocess sockets in a child process, as it would keep
+ * the coprocesses from seeing end of file. */
+void resetcoprocs(void)
+{
+  while (ncoprocs > 0)
+    closecoproc(coprocs[0].name);
+}
+
+void showcoprocs(void)
+{
+  for (int i = 0; i < ncoprocs; i++)
+    printf("%-16s fd %d\n", coprocs[i].name, coprocs[i].fd);
+}
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "shell.h"
+
+/* Event loop serves file descriptors (e.g. timers) while the shell sleeps:
+ * waiting for user input, for foreground job or for a jobserver token. */
+
+typedef struct
+{
+  int fd;        /* descriptor to poll for input */
+  bool timer;    /* expirations must be read out of timerfd */
+  evfunc_t func; /* called when fd becomes readable */
+  void *arg;     /* passed to func */
+} event_t;
+
+static event_t *events = NULL; /* array of registered event sources */
+static int nevents = 0;        /* number of event sources */
+
+static event_t *findevent(int fd)
+{
+  for (int i = 0; i < nevents; i++)
+    if (events[i].fd == fd)
+      return &events[i];
+  return NULL;
+}
+
+void addevent(int fd, evfunc_t func, void *arg)
+{
+  assert(findevent(fd) == NULL);
+  events = realloc(events, sizeof(event_t) * (nevents + 1));
+  events[nevents++] = (event_t){.fd = fd, .func = func, .arg = arg};
+}
+
+void delevent(int fd)
+{
+  event_t *ev = findevent(fd);
+  if (ev)
+    *ev = events[--nevents];
+}
+
+/* Create a timer that calls 'func' after 'msec' milliseconds, and then
+ * every 'msec' milliseconds if 'periodic' is set. Returns timer's fd. */
+int addtimer(long msec, bool periodic, evfunc_t func, void *arg)
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    unix_error("timerfd_create error");
+
+  settimer(fd, msec, periodic);
+  addevent(fd, func, arg);
+  findevent(fd)->timer = true;
+  return fd;
+}
+
+/* Rearm timer or disarm it if 'msec' is zero. */
+void settimer(int fd, long msec, bool periodic)
+{
+  struct itimerspec its = {
+    .it_value = {.tv_sec = msec / 1000, .tv_nsec = (msec % 1000) * 1000000},
+  };
+  if (periodic)
+    its.it_interval = its.it_value;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    unix_error("timerfd_settime error");
+}
+
+void deltimer(int fd)
+{
+  delevent(fd);
+  Close(fd);
+}
+
+/* Drop all event sources in a child process. Timers are shared with the
+ * parent, which would miss their expirations if the child read them out. */
+void resetevents(void)
+{
+  for (int i = 0; i < nevents; i++)
+    Close(events[i].fd);
+  nevents = 0;
+}
+
+/* Sleep until a signal not blocked by 'mask' gets delivered, an event source
+ * fires or one of 'nfds' descriptors from 'fds' becomes readable. Serve all
+ * events that are pending. Returns true if any of 'fds' is readable. */
+bool waitevents(const int *fds, int nfds, const sigset_t *mask)
+{
+  int n = nevents + nfds;
+  struct pollfd pfd[n];
+
+  for (int i = 0; i < nevents; i++)
+    pfd[i] = (struct pollfd){.fd = events[i].fd, .events = POLLIN};
+  for (int i = 0; i < nfds; i++)
+    pfd[nevents + i] = (struct pollfd){.fd = fds[i], .events = POLLIN};
+
+  if (ppoll(pfd, n, NULL, mask) < 0)
+  {
+    if (errno != EINTR)
+      unix_error("ppoll error");
+    return false;
+  }
+
+  /* Callbacks may add or remove events, so look each one up again. */
+  for (int i = 0; i < n - nfds; i++)
+  {
+    if (!(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+      continue;
+
+    event_t *ev = findevent(pfd[i].fd);
+    if (!ev)
+      continue;
+
+    if (ev->timer)
+    {
+      uint64_t expirations;
+      if (read(ev->fd, &expirations, sizeof(expirations)) < 0)
+        continue;
+    }
+    ev->func(ev->fd, ev->arg);
+  }
+
+  for (int i = n - nfds; i < n; i++)
+    if (pfd[i].fd >= 0 && (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+      return true;
+  return false;
+}
+
+/* Same as above for a single descriptor, which is ignored if negative. */
+bool waitevent(int fd, const sigset_t *mask)
+{
+  return waitevents(&fd, 1, mask);
+}
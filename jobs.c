@@ -1,64 +1,211 @@
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
 #include "shell.h"
+#include "queue.h"
+#include "tree.h"
 
+/* Process slots are scanned on every SIGCHLD, so they hold only what's
+ * needed to find a process and tell its state. */
 typedef struct proc
 {
   pid_t pid;    /* process identifier */
+  int pidfd;    /* open until the process is buried, -1 if none */
   int state;    /* RUNNING or STOPPED or FINISHED */
   int exitcode; /* -1 if exit status not yet received */
+  bool adopted; /* escaped from the job and was reparented to us */
 } proc_t;
 
-typedef struct job
+/* Cold part of a process, kept in job's side array parallel to its slots. */
+typedef struct procinfo
+{
+  struct timespec start; /* when the process was started */
+  struct timespec end;   /* when the process was buried */
+  struct timeval utime;  /* user CPU time used */
+  struct timeval stime;  /* system CPU time used */
+  long maxrss;           /* maximum resident set size in kilobytes */
+  long nvcsw;            /* voluntary context switches */
+  long nivcsw;           /* involuntary context switches */
+  limits_t limits;       /* limits the process was started with */
+  size_t argv;           /* offset of process' words in job's arena */
+  int argc;              /* number of words, 0 if there's no command text */
+} procinfo_t;
+
+/* Background jobs are kept on a list ordered from the most recently used one,
+ * so current ('%+') and previous ('%-') job are found right away, and in a
+ * tree ordered by the first word of their command for '%prefix' specs.
+ * Entries refer to jobs by index, as jobs move between slots. */
+typedef struct jobref
+{
+  TAILQ_ENTRY(jobref) mru; /* link on most recently used list */
+  RB_ENTRY(jobref) node;   /* node of tree ordered by name */
+  char *name;              /* first word of the command or NULL */
+  int seq;                 /* orders jobs with the same name */
+  int job;                 /* index in jobs array */
+  bool linked;             /* entry is on the list and in the tree */
+} jobref_t;
+
+/* Cold part of a job, which is needed only once the job has been found. */
+typedef struct jobinfo
 {
-  pid_t pgid;            /* 0 if slot is free */
-  proc_t *proc;          /* array of processes running in as a job */
   struct termios tmodes; /* saved terminal modes */
-  int nproc;             /* number of processes */
-  int state;             /* changes when live processes have same state */
-  char *command;         /* textual representation of command line */
+  procinfo_t *procs;     /* cold part of each of job's processes */
+  char *args;            /* words of all processes, each NUL-terminated */
+  size_t argsize;        /* number of bytes used in the arena */
+  size_t argcap;         /* number of bytes allocated for the arena */
+  char *command;         /* rendered from 'args' when needed, or NULL */
+  int gate;              /* write end of pipe batch leader waits on or -1 */
+  int feed;              /* counts finished chunks of a batch job or -1 */
+  chunkfunc_t chunkfunc; /* starts a chunk of a batch job */
+  void *chunkarg;        /* passed to 'chunkfunc', owned by the job */
+  int nextchunk;         /* index of next chunk to start */
+  int nchunks;           /* number of chunks to start */
+  char *tokens;          /* jobserver tokens held by the job */
+  int ntokens;           /* number of jobserver tokens */
+  bool timed;            /* report resource usage when job is finished */
+  bool throttle_stopped; /* job is in stop phase */
+  int timeout_timer;     /* fires when job runs out of time, -1 if none */
+  bool timedout;         /* job was terminated because it ran out of time */
+  jobref_t ref;          /* entry for job specs */
+} jobinfo_t;
+
+/* Job table gets scanned on every SIGCHLD and by every policy, so its slots
+ * hold only what's needed to find a job, tell its state and pick it by
+ * policies: 'pausejob', 'unpausejob', 'demotejobs' and 'throttle_tick'. */
+typedef struct job
+{
+  pid_t pgid;          /* 0 if slot is free */
+  int state;           /* changes when live processes have same state */
+  int nproc;           /* number of processes */
+  int seq;             /* jobs started later have higher numbers */
+  proc_t *proc;        /* array of processes running in as a job */
+  jobinfo_t *info;     /* the rest of job's data, NULL if slot is free */
+  int throttle;        /* percentage of time the job may run, 0 if off */
+  int throttle_timer;  /* switches between run and stop phase */
+  bool paused;         /* stopped by pressure policy */
+  bool demoted;        /* priority lowered while foreground job runs */
 } job_t;
 
 static job_t *jobs = NULL;          /* array of all jobs */
 static int njobmax = 1;             /* number of slots in jobs array */
+static int lastbg = -1;             /* most recently started background job */
+static int jobseq = 0;              /* sequence number of last started job */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
+static int shell_nice;              /* inherited by all jobs */
+static int shell_ioprio;            /* inherited by all jobs */
+static bool subreaper = false;      /* orphaned descendants are reparented to us */
+static pid_t jobtag = 0;            /* job of a child process, see 'joinjob' */
+static volatile bool orphans = false; /* some processes could have been adopted */
+
+static int cmpjobref(jobref_t *a, jobref_t *b)
+{
+  int c = strcmp(a->name, b->name);
+  return c ? c : a->seq - b->seq;
+}
+
+static TAILQ_HEAD(, jobref) mrujobs = TAILQ_HEAD_INITIALIZER(mrujobs);
+static RB_HEAD(jobtree, jobref) namedjobs = RB_INITIALIZER(&namedjobs);
+RB_GENERATE_STATIC(jobtree, jobref, node, cmpjobref);
+
+/* Chunk of a batch job has finished, so next one may start. Processes can't
+ * be forked in signal handler, so 'feed_tick' does it. */
+static void opengate(job_t *job)
+{
+  uint64_t one = 1;
+  if (job->info->gate >= 0)
+    (void)write(job->info->feed, &one, sizeof(one));
+}
+
+/* Let batch leader go, once there are no more chunks to start. */
+static void closegate(job_t *job)
+{
+  if (job->info->gate < 0)
+    return;
+  (void)close(job->info->gate);
+  job->info->gate = -1;
+}
+
+/* Job is finished when all its processes are, and it's stopped when all of
+ * live processes are stopped. Otherwise it's running. */
+static int procstate(job_t *job)
+{
+  int state = FINISHED;
+  for (int i = 0; i < job->nproc; i++)
+  {
+    if (job->proc[i].state == RUNNING)
+      return RUNNING;
+    if (job->proc[i].state == STOPPED)
+      state = STOPPED;
+  }
+  return state;
+}
 
 static void sigchld_handler(int sig)
 {
   int old_errno = errno;
   pid_t pid;
   int status;
+  struct rusage ru;
   // TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
   // Bury all children that finished saving their status in jobs.* /
 
-  while (0 < (pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)))
+  while (0 < (pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)))
   {
     for (int i = 0; i < njobmax; i++)
     {
+      job_t *job = &jobs[i];
 
-      if (jobs[i].nproc == 0)
-      {
-        jobs[i].state = FINISHED;
-      }
-      else
+      if (job->pgid == 0)
+        continue;
+
+      for (int j = 0; j < job->nproc; j++)
       {
-        for (int j = 0; j < jobs[i].nproc; j++)
+        proc_t *proc = &job->proc[j];
+
+        if (pid != proc->pid)
+          continue;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status))
         {
-          if (pid == jobs[i].proc->pid)
+          proc->state = FINISHED;
+          proc->exitcode = status;
+          procinfo_t *info = &job->info->procs[j];
+          clock_gettime(CLOCK_MONOTONIC, &info->end);
+          info->utime = ru.ru_utime;
+          info->stime = ru.ru_stime;
+          info->maxrss = ru.ru_maxrss;
+          info->nvcsw = ru.ru_nvcsw;
+          info->nivcsw = ru.ru_nivcsw;
+          if (proc->pidfd >= 0)
           {
-            if (WIFEXITED(status) || WIFSIGNALED(status))
-            {
-              jobs[i].state = FINISHED;
-              jobs[i].proc[j].exitcode = status;
-            }
-            if (WIFSTOPPED(status))
-            {
-              jobs[i].state = STOPPED;
-            }
-            if (WIFCONTINUED(status))
-            {
-              jobs[i].state = RUNNING;
-            }
+            (void)close(proc->pidfd);
+            proc->pidfd = -1;
           }
+          /* Batch leader is the first process of the job, and orphans
+           * adopted by the job don't run chunks. */
+          if (j == 0)
+            closegate(job);
+          else if (!proc->adopted)
+            opengate(job);
+          /* Children of the process are our children now. */
+          orphans = subreaper;
+        }
+        /* Throttled job gets stopped with SIGSTOP all the time. */
+        if (WIFSTOPPED(status) &&
+            !(job->throttle && WSTOPSIG(status) == SIGSTOP))
+        {
+          proc->state = STOPPED;
+        }
+        if (WIFCONTINUED(status))
+        {
+          proc->state = RUNNING;
+        }
+        job->state = procstate(job);
+        if (job->state == FINISHED)
+        {
+          puttokens(job->info->tokens, job->info->ntokens);
+          job->info->ntokens = 0;
         }
       }
     }
@@ -67,10 +214,34 @@ static void sigchld_handler(int sig)
   errno = old_errno;
 }
 
-/* When pipeline is done, its exitcode is fetched from the last process. */
+/* Batch job fails if any chunk does, with 123 like xargs(1), unless a chunk
+ * got killed by a signal, which is reported instead. */
+static int batchexitcode(job_t *job)
+{
+  int status = 0;
+  for (int i = 0; i < job->nproc; i++)
+  {
+    int s = job->proc[i].exitcode;
+    if (job->proc[i].adopted || s == 0)
+      continue;
+    if (WIFSIGNALED(s))
+      return s;
+    status = W_EXITCODE(123, 0);
+  }
+  return status;
+}
+
+/* When pipeline is done, its exitcode is fetched from the last process.
+ * Processes adopted by the job do not count. */
 static int exitcode(job_t *job)
 {
-  return job->proc[job->nproc - 1].exitcode;
+  if (job->info->nchunks > 0)
+    return batchexitcode(job);
+
+  int i = job->nproc - 1;
+  while (i > 0 && job->proc[i].adopted)
+    i--;
+  return job->proc[i].exitcode;
 }
 
 static int allocjob(void)
@@ -89,33 +260,173 @@ static int allocjob(void)
 static int allocproc(int j)
 {
   job_t *job = &jobs[j];
+  jobinfo_t *info = job->info;
   job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+  info->procs = realloc(info->procs, sizeof(procinfo_t) * (job->nproc + 1));
   return job->nproc++;
 }
 
+/* Make the job current one. Its name is indexed once it's known. */
+static void linkjob(job_t *job)
+{
+  jobref_t *ref = &job->info->ref;
+  if (ref->linked)
+    TAILQ_REMOVE(&mrujobs, ref, mru);
+  else if (ref->name)
+    RB_INSERT(jobtree, &namedjobs, ref);
+  TAILQ_INSERT_HEAD(&mrujobs, ref, mru);
+  ref->linked = true;
+}
+
+static void unlinkjob(job_t *job)
+{
+  jobref_t *ref = &job->info->ref;
+  if (!ref->linked)
+    return;
+  TAILQ_REMOVE(&mrujobs, ref, mru);
+  if (ref->name)
+    RB_REMOVE(jobtree, &namedjobs, ref);
+  ref->linked = false;
+}
+
 int addjob(pid_t pgid, int bg)
 {
   int j = bg ? allocjob() : FG;
   job_t *job = &jobs[j];
+  if (bg)
+    lastbg = j;
   /* Initial state of a job. */
-  job->pgid = pgid;
-  job->state = RUNNING;
-  job->command = NULL;
-  job->proc = NULL;
-  job->nproc = 0;
-  job->tmodes = shell_tmodes;
+  *job = (job_t){.pgid = pgid,
+                 .state = RUNNING,
+                 .seq = ++jobseq,
+                 .throttle_timer = -1};
+  job->info = calloc(1, sizeof(jobinfo_t));
+  job->info->tmodes = shell_tmodes;
+  job->info->gate = -1;
+  job->info->feed = -1;
+  job->info->timeout_timer = -1;
+  job->info->ref = (jobref_t){.seq = job->seq, .job = j};
+  if (bg)
+    linkjob(job);
   return j;
 }
 
+/* Returns the job most recently started in background, or -1 if there was
+ * none since previous call. */
+int lastjob(void)
+{
+  int j = lastbg;
+  lastbg = -1;
+  return j;
+}
+
+static double tv2sec(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double ts2sec(struct timespec ts)
+{
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Sum up resource usage of all processes of a job. Wall clock time spans from
+ * start of the first process till the end of the last one (or till now). */
+static void jobusage(job_t *job, procinfo_t *total)
+{
+  memset(total, 0, sizeof(procinfo_t));
+  total->start = job->info->procs[0].start;
+  clock_gettime(CLOCK_MONOTONIC, &total->end);
+
+  if (job->state == FINISHED)
+    total->end = job->info->procs[0].end;
+
+  for (int i = 0; i < job->nproc; i++)
+  {
+    procinfo_t *proc = &job->info->procs[i];
+    if (ts2sec(proc->start) < ts2sec(total->start))
+      total->start = proc->start;
+    if (job->state == FINISHED && ts2sec(proc->end) > ts2sec(total->end))
+      total->end = proc->end;
+    timeradd(&total->utime, &proc->utime, &total->utime);
+    timeradd(&total->stime, &proc->stime, &total->stime);
+    total->maxrss = max(total->maxrss, proc->maxrss);
+    total->nvcsw += proc->nvcsw;
+    total->nivcsw += proc->nivcsw;
+  }
+}
+
+/* Print resource usage of a process in 'state'. Usage of a process that is
+ * still alive is not known yet, except for wall clock time. */
+static void showusage(FILE *out, int state, procinfo_t *proc)
+{
+  struct timespec end = proc->end;
+
+  if (state != FINISHED)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(out, "real %.3fs\n", ts2sec(end) - ts2sec(proc->start));
+    return;
+  }
+
+  fprintf(out, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldkB  csw %ld/%ld\n",
+          ts2sec(end) - ts2sec(proc->start), tv2sec(proc->utime),
+          tv2sec(proc->stime), proc->maxrss, proc->nvcsw, proc->nivcsw);
+}
+
+/* Report resource usage of each process of a job (if there's more than one)
+ * and of the job as a whole. */
+static void timereport(job_t *job)
+{
+  procinfo_t total;
+
+  if (job->nproc > 1)
+  {
+    for (int i = 0; i < job->nproc; i++)
+    {
+      fprintf(stderr, "%8d  ", job->proc[i].pid);
+      showusage(stderr, job->proc[i].state, &job->info->procs[i]);
+    }
+  }
+
+  jobusage(job, &total);
+  fprintf(stderr, "%8s  ", "total");
+  showusage(stderr, job->state, &total);
+}
+
+/* Finished job started with 'time' reports its resource usage when it gets
+ * deleted. */
 static void deljob(job_t *job)
 {
   assert(job->state == FINISHED);
-  free(job->command);
+  if (job->info->timed)
+    timereport(job);
+  closegate(job);
+  if (job->info->feed >= 0)
+  {
+    delevent(job->info->feed);
+    Close(job->info->feed);
+  }
+  free(job->info->chunkarg);
+  if (job->throttle_timer >= 0)
+    deltimer(job->throttle_timer);
+  if (job->info->timeout_timer >= 0)
+    deltimer(job->info->timeout_timer);
+  for (int i = 0; i < job->nproc; i++)
+    if (job->proc[i].pidfd >= 0)
+      Close(job->proc[i].pidfd);
+  unlinkjob(job);
+  free(job->info->ref.name);
+  free(job->info->args);
+  free(job->info->command);
+  free(job->info->tokens);
+  free(job->info->procs);
+  free(job->info);
   free(job->proc);
   job->pgid = 0;
-  job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
+  job->info = NULL;
 }
 
 static void movejob(int from, int to)
@@ -123,18 +434,86 @@ static void movejob(int from, int to)
   assert(jobs[to].pgid == 0);
   memcpy(&jobs[to], &jobs[from], sizeof(job_t));
   memset(&jobs[from], 0, sizeof(job_t));
+  if (jobs[to].info)
+    jobs[to].info->ref.job = to;
+}
+
+/* Copy words of a process into job's arena. Command text is not needed on
+ * the spawn path, so it's rendered later by 'mkcommand'. */
+static void saveargv(job_t *job, procinfo_t *proc, char **argv)
+{
+  size_t size = 0;
+  int argc;
+
+  for (argc = 0; argv[argc]; argc++)
+    size += strlen(argv[argc]) + 1;
+
+  if (job->info->argsize + size > job->info->argcap)
+  {
+    job->info->argcap = max(job->info->argcap * 2, job->info->argsize + size);
+    job->info->args = realloc(job->info->args, job->info->argcap);
+  }
+
+  proc->argv = job->info->argsize;
+  proc->argc = argc;
+  free(job->info->command);
+  job->info->command = NULL;
+  for (int i = 0; i < argc; i++)
+  {
+    size_t len = strlen(argv[i]) + 1;
+    memcpy(job->info->args + job->info->argsize, argv[i], len);
+    job->info->argsize += len;
+  }
 }
 
-static void mkcommand(char **cmdp, char **argv)
+/* Join words of processes into a command line like 'a b | c d'. Separators
+ * take place of terminating NULs, except for pipes that take two bytes more. */
+static char *mkcommand(job_t *job)
 {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+  if (job->info->command)
+    return job->info->command;
 
-  for (strapp(cmdp, *argv++); *argv; argv++)
+  char *cmd = malloc(job->info->argsize + 2 * job->nproc + 1);
+  char *s = cmd;
+
+  for (int p = 0; p < job->nproc; p++)
   {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+    procinfo_t *proc = &job->info->procs[p];
+    const char *word = job->info->args + proc->argv;
+
+    if (proc->argc == 0)
+      continue;
+    if (s > cmd)
+      s = stpcpy(s, " | ");
+    for (int i = 0; i < proc->argc; i++)
+    {
+      size_t len = strlen(word);
+      if (i > 0)
+        *s++ = ' ';
+      memcpy(s, word, len);
+      s += len;
+      word += len + 1;
+    }
   }
+  *s = '\0';
+
+  return job->info->command = cmd;
+}
+
+/* Process descriptor refers to the process itself rather than to its pid,
+ * so it can't hit an unrelated process after the pid gets reused. Returns
+ * -1 if the process is gone or the kernel does not support pidfds. */
+static int openpid(pid_t pid)
+{
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void sendsignal(int pidfd, pid_t pid, int sig)
+{
+  if (pidfd >= 0)
+    (void)syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+  else
+    (void)kill(pid, sig);
 }
 
 void addproc(int j, pid_t pid, char **argv)
@@ -148,7 +527,356 @@ void addproc(int j, pid_t pid, char **argv)
   proc->pid = pid;
   proc->state = RUNNING;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  proc->adopted = false;
+  /* Process can't be buried before it's added, as SIGCHLD is blocked. */
+  proc->pidfd = openpid(pid);
+  procinfo_t *info = &job->info->procs[p];
+  memset(info, 0, sizeof(procinfo_t));
+  clock_gettime(CLOCK_MONOTONIC, &info->start);
+  /* Processes started by 'batch' share single command text. */
+  if (argv)
+    saveargv(job, info, argv);
+  if (argv && !job->info->ref.name)
+  {
+    bool linked = job->info->ref.linked;
+    unlinkjob(job);
+    job->info->ref.name = strdup(argv[0]);
+    if (linked)
+      linkjob(job);
+  }
+}
+
+/* Start next chunk of a batch job. Its leader goes once all have started. */
+static void startchunk(int j)
+{
+  job_t *job = &jobs[j];
+  jobinfo_t *info = job->info;
+
+  pid_t pid = info->chunkfunc(job->pgid, info->nextchunk, info->chunkarg);
+  addproc(j, pid, NULL);
+  if (++info->nextchunk == info->nchunks)
+    closegate(&jobs[j]);
+}
+
+/* Start as many chunks as have finished since last time. Job is identified
+ * by its pgid, as it can be moved between slots. */
+static void feed_tick(int fd, void *arg)
+{
+  pid_t pgid = (intptr_t)arg;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  uint64_t nfinished;
+  if (read(fd, &nfinished, sizeof(nfinished)) == sizeof(nfinished))
+  {
+    for (int j = 0; j < njobmax; j++)
+    {
+      if (jobs[j].pgid != pgid || jobs[j].info->feed != fd)
+        continue;
+      while (nfinished-- > 0 && jobs[j].info->gate >= 0)
+        startchunk(j);
+      break;
+    }
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Make job a batch of 'nchunks' chunks, each started by 'func' in job's
+ * process group when it's its turn. First 'nparallel' start right away, the
+ * rest one by one as their predecessors finish. Job's first process is its
+ * leader, which keeps the group until last chunk has started, and waits for
+ * the write end 'fd' of a pipe to get closed. Job takes ownership of 'fd' and
+ * of 'arg', which must be a single block of memory. */
+void gatejob(int j, int fd, int nchunks, int nparallel, chunkfunc_t func,
+             void *arg)
+{
+  assert(j < njobmax);
+  jobinfo_t *info = jobs[j].info;
+
+  info->gate = fd;
+  info->feed = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (info->feed < 0)
+    unix_error("eventfd error");
+  addevent(info->feed, feed_tick, (void *)(intptr_t)jobs[j].pgid);
+  info->chunkfunc = func;
+  info->chunkarg = arg;
+  info->nextchunk = 0;
+  info->nchunks = nchunks;
+
+  for (int i = 0; i < nparallel && info->gate >= 0; i++)
+    startchunk(j);
+}
+
+void timejob(int j)
+{
+  assert(j < njobmax);
+  jobs[j].info->timed = true;
+}
+
+/* Record limits the most recently added process of a job was started with.
+ * Priority policies restore its nice value from them. */
+void limitproc(int j, const limits_t *limits)
+{
+  assert(j < njobmax);
+  job_t *job = &jobs[j];
+
+  job->info->procs[job->nproc - 1].limits = *limits;
+}
+
+/* Job holds jobserver tokens until it finishes. */
+void tokenjob(int j, const char *tokens, int n)
+{
+  assert(j < njobmax);
+  job_t *job = &jobs[j];
+
+  job->info->tokens = realloc(job->info->tokens, job->info->ntokens + n);
+  memcpy(job->info->tokens + job->info->ntokens, tokens, n);
+  job->info->ntokens += n;
+}
+
+/* In subreaper mode processes that escape the job by double forking (with or
+ * without setsid) get reparented to the shell instead of init. Each of them
+ * is attributed back to the job it came from and becomes one of the job's
+ * processes. Process belongs to a job if it's still in job's process group
+ * or its environment carries job's tag, see 'tagproc'. */
+
+#define JOBTAG "SHELL_JOB_PGID"
+
+/* Turn subreaper mode on or off. */
+void subreaperjobs(bool enable)
+{
+  Prctl(PR_SET_CHILD_SUBREAPER, enable);
+  subreaper = enable;
+}
+
+bool subreaper_p(void)
+{
+  return subreaper;
+}
+
+/* Put tag of job 'pgid' into environment of a process about to execve. */
+void tagjob(pid_t pgid)
+{
+  char tag[16];
+  snprintf(tag, sizeof(tag), "%d", pgid);
+  setenv(JOBTAG, tag, 1);
+}
+
+/* Called in a child process before execve. */
+void tagproc(void)
+{
+  if (subreaper)
+    tagjob(jobtag ? jobtag : getpgrp());
+}
+
+/* Job control is on only if the shell has got a terminal. Otherwise jobs
+ * stay in shell's process group, so they may use the terminal just like the
+ * shell does, and they're signalled by pid. Job is still identified by pid
+ * of its first process, as if it was a process group id. */
+bool jobcontrol_p(void)
+{
+  return tty_fd >= 0;
+}
+
+/* Called in a child process that becomes part of job 'pgid', or starts a new
+ * job if it's 0. Without job control background job ignores keyboard
+ * interrupts, since it shares shell's process group, as POSIX requires. */
+void joinjob(pid_t pgid, bool bg)
+{
+  jobtag = pgid ? pgid : getpid();
+  if (jobcontrol_p())
+  {
+    Setpgid(0, pgid);
+  }
+  else if (bg)
+  {
+    Signal(SIGINT, SIG_IGN);
+    Signal(SIGQUIT, SIG_IGN);
+  }
+}
+
+/* Read whole contents of a small /proc file. Returns number of bytes read
+ * and the contents terminated with extra NUL character under 'bufp'. */
+static ssize_t readproc(const char *path, char **bufp)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  size_t size = 0, cap = 256;
+  char *buf = malloc(cap);
+  ssize_t n;
+
+  while ((n = read(fd, buf + size, cap - size - 1)) > 0)
+  {
+    size += n;
+    if (size + 1 == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  Close(fd);
+
+  buf[size] = '\0';
+  *bufp = buf;
+  return size;
+}
+
+/* Returns zero-terminated array of children of a process. */
+static pid_t *childrenof(pid_t pid)
+{
+  char path[64], *buf = NULL;
+  pid_t *children = malloc(sizeof(pid_t));
+  int n = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+  if (readproc(path, &buf) > 0)
+  {
+    for (char *s = buf, *end; (pid = strtol(s, &end, 10)) > 0; s = end)
+    {
+      children = realloc(children, sizeof(pid_t) * (n + 2));
+      children[n++] = pid;
+    }
+  }
+  if (buf)
+    free(buf);
+  children[n] = 0;
+  return children;
+}
+
+/* Find job that orphaned process 'pid' comes from. */
+static job_t *orphanjob(pid_t pid)
+{
+  char path[64], *buf = NULL;
+  pid_t pgid = -1;
+  ssize_t n;
+
+  /* Command name may contain spaces and parentheses, so skip it. */
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if (readproc(path, &buf) > 0 && rindex(buf, ')'))
+    sscanf(rindex(buf, ')') + 2, "%*c %*d %d", &pgid);
+  free(buf);
+
+  for (int j = 0; j < njobmax; j++)
+    if (jobs[j].pgid && jobs[j].pgid == pgid)
+      return &jobs[j];
+
+  snprintf(path, sizeof(path), "/proc/%d/environ", pid);
+  if ((n = readproc(path, &buf)) < 0)
+    return NULL;
+
+  pgid = -1;
+  for (char *var = buf; var < buf + n; var += strlen(var) + 1)
+    if (!strncmp(var, JOBTAG "=", sizeof(JOBTAG)))
+      pgid = atoi(var + sizeof(JOBTAG));
+  free(buf);
+
+  for (int j = 0; j < njobmax; j++)
+    if (jobs[j].pgid && jobs[j].pgid == pgid)
+      return &jobs[j];
+  return NULL;
+}
+
+static bool knownproc(pid_t pid)
+{
+  for (int j = 0; j < njobmax; j++)
+    for (int i = 0; jobs[j].pgid && i < jobs[j].nproc; i++)
+      if (jobs[j].proc[i].pid == pid)
+        return true;
+  return false;
+}
+
+/* Look for processes reparented to the shell and add them to their jobs. */
+static void adoptorphans(void)
+{
+  if (!orphans)
+    return;
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  orphans = false;
+
+  pid_t *children = childrenof(getpid());
+  for (pid_t *pidp = children; *pidp; pidp++)
+  {
+    job_t *job;
+    if (knownproc(*pidp) || !(job = orphanjob(*pidp)))
+      continue;
+
+    int j = job - jobs;
+    debug("[%d] adopted %d\n", j, *pidp);
+    addproc(j, *pidp, NULL);
+    job->proc[job->nproc - 1].adopted = true;
+    job->state = procstate(job);
+  }
+  free(children);
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Returns parent of a process or -1 if it's gone. */
+static pid_t parentof(pid_t pid)
+{
+  char path[64], *buf = NULL;
+  pid_t ppid = -1;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if (readproc(path, &buf) > 0 && rindex(buf, ')'))
+    sscanf(rindex(buf, ')') + 2, "%*c %d", &ppid);
+  free(buf);
+  return ppid;
+}
+
+/* Signal process and all its descendants, children first. Descendant could
+ * have been buried after it was listed, so it's signalled only if its pid
+ * still belongs to a child of 'pid' once we hold a descriptor of it. */
+static void killtree(int pidfd, pid_t pid, int sig)
+{
+  pid_t *children = childrenof(pid);
+  for (pid_t *pidp = children; *pidp; pidp++)
+  {
+    int fd = openpid(*pidp);
+    if (fd >= 0 && parentof(*pidp) == pid)
+      killtree(fd, *pidp, sig);
+    if (fd >= 0)
+      Close(fd);
+  }
+  free(children);
+  sendsignal(pidfd, pid, sig);
+}
+
+/* Signal the job's process group, and in subreaper mode also all live
+ * processes of the job and their descendants, wherever they are. Process
+ * group id can't be reused while any of its members is not buried, so the
+ * group is signalled only if some process of the job is still alive. Without
+ * job control there's no group, so live processes are signalled one by one.
+ * Caller must block SIGCHLD. */
+static void signaljob(job_t *job, int sig)
+{
+  if (procstate(job) == FINISHED)
+    return;
+  if (jobcontrol_p())
+    killpg(job->pgid, sig);
+  for (int i = 0; i < job->nproc; i++)
+  {
+    proc_t *proc = &job->proc[i];
+    if (proc->state == FINISHED)
+      continue;
+    if (subreaper)
+      killtree(proc->pidfd, proc->pid, sig);
+    else if (!jobcontrol_p())
+      sendsignal(proc->pidfd, proc->pid, sig);
+  }
+}
+
+/* Returns true if processes the job was started with have finished, while
+ * adopted ones are still alive. Exit code is returned through 'statusp'. */
+static bool orphaned_p(job_t *job, int *statusp)
+{
+  for (int i = 0; i < job->nproc; i++)
+    if (!job->proc[i].adopted && job->proc[i].state != FINISHED)
+      return false;
+  *statusp = exitcode(job);
+  return true;
 }
 
 /* Returns job's state.
@@ -156,6 +884,7 @@ void addproc(int j, pid_t pid, char **argv)
 int jobstate(int j, int *statusp)
 {
   assert(j < njobmax);
+  adoptorphans();
   job_t *job = &jobs[j];
   int state = job->state;
 
@@ -163,7 +892,7 @@ int jobstate(int j, int *statusp)
 
   if (state == FINISHED)
   {
-    statusp = job->proc[0].exitcode;
+    *statusp = exitcode(job);
     deljob(job);
   }
 
@@ -174,7 +903,51 @@ char *jobcmd(int j)
 {
   assert(j < njobmax);
   job_t *job = &jobs[j];
-  return job->command;
+  return mkcommand(job);
+}
+
+/* Job with a name starting with 'prefix' that was started last, if any. */
+static jobref_t *prefixjob(const char *prefix)
+{
+  jobref_t key = {.name = (char *)prefix, .seq = 0}, *found = NULL;
+  size_t len = strlen(prefix);
+
+  for (jobref_t *ref = RB_NFIND(jobtree, &namedjobs, &key);
+       ref && !strncmp(ref->name, prefix, len);
+       ref = RB_NEXT(jobtree, &namedjobs, ref))
+    if (!found || ref->seq > found->seq)
+      found = ref;
+  return found;
+}
+
+/* Resolve job spec given without leading '%': '+', '%' or nothing for the
+ * current job, '-' for the previous one, job number, '?substring' of job's
+ * command or prefix of it. If several jobs match, the one started last is
+ * chosen. Returns -1 if there's no such job. */
+int findjob(const char *spec)
+{
+  jobref_t *ref = TAILQ_FIRST(&mrujobs);
+
+  if (!strcmp(spec, "-"))
+    ref = ref ? TAILQ_NEXT(ref, mru) : NULL;
+  else if (isdigit(*spec))
+  {
+    int j = atoi(spec);
+    return j >= BG && j < njobmax && jobs[j].pgid ? j : -1;
+  }
+  else if (*spec == '?')
+  {
+    jobref_t *found = NULL;
+    TAILQ_FOREACH(ref, &mrujobs, mru)
+      if ((!found || ref->seq > found->seq) &&
+          strstr(mkcommand(&jobs[ref->job]), spec + 1))
+        found = ref;
+    ref = found;
+  }
+  else if (*spec && strcmp(spec, "+") && strcmp(spec, "%"))
+    ref = prefixjob(spec);
+
+  return ref ? ref->job : -1;
 }
 
 /* Continues a job that has been stopped. If move to foreground was requested,
@@ -182,164 +955,723 @@ char *jobcmd(int j)
 bool resumejob(int j, int bg, sigset_t *mask)
 {
   if (j < 0)
-  {
-    for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--)
-      continue;
-  }
+    j = findjob("+");
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j < 0 || j >= njobmax || jobs[j].state == FINISHED)
     return false;
 
   // TODO: Continue stopped job. Possibly move job to foreground slot. */
 
-  killpg(jobs[j].pgid, SIGCONT);
+  signaljob(&jobs[j], SIGCONT);
   jobs[j].state = RUNNING;
+  jobs[j].paused = false;
+  jobs[j].info->throttle_stopped = false;
 
   if (bg == FG)
   {
+    unlinkjob(&jobs[j]);
     movejob(j, 0);
     monitorjob(mask);
   }
+  else
+  {
+    linkjob(&jobs[j]);
+  }
 
   return true;
 }
 
-/* Kill the job by sending it a SIGTERM. */
-bool killjob(int j)
+/* Stop the youngest running background job to relieve the system. */
+int pausejob(void)
 {
-  if (j >= njobmax || jobs[j].state == FINISHED)
-    return false;
-  debug("[%d] killing '%s'\n", j, jobs[j].command);
+  int youngest = -1;
 
-  // TODO: I love the smell of napalm in the morning. */
+  for (int j = BG; j < njobmax; j++)
+  {
+    if (jobs[j].pgid == 0 || jobs[j].state != RUNNING || jobs[j].throttle)
+      continue;
+    if (youngest < 0 || jobs[j].seq > jobs[youngest].seq)
+      youngest = j;
+  }
 
-  if (jobs[j].state == STOPPED)
-    kill(jobs[j].pgid, SIGCONT);
-  kill(jobs[j].pgid, SIGTERM);
+  if (youngest < 0)
+    return -1;
 
-  return true;
+  debug("[%d] pausing '%s'\n", youngest, mkcommand(&jobs[youngest]));
+  signaljob(&jobs[youngest], SIGSTOP);
+  jobs[youngest].paused = true;
+  return youngest;
 }
 
-/* Report state of requested background jobs. Clean up finished jobs. */
-void watchjobs(int which)
+/* Continue the oldest job stopped by 'pausejob'. */
+bool unpausejob(sigset_t *mask)
 {
-  // printf("dupa");
+  int oldest = -1;
+
   for (int j = BG; j < njobmax; j++)
   {
-    if (jobs[j].pgid == 0)
+    if (jobs[j].pgid == 0 || !jobs[j].paused)
       continue;
+    if (oldest < 0 || jobs[j].seq < jobs[oldest].seq)
+      oldest = j;
+  }
+
+  if (oldest < 0)
+    return false;
+
+  debug("[%d] unpausing '%s'\n", oldest, mkcommand(&jobs[oldest]));
+  return resumejob(oldest, BG, mask);
+}
+
+/* Sleep until some process of one of 'n' jobs from 'js' finishes or other
+ * event fires. SIGCHLD is kept blocked and processes' descriptors get polled
+ * instead, so children that are not of interest do not wake us up. Without
+ * pidfds fall back to waiting for SIGCHLD. Caller must block SIGCHLD. */
+void waitjobs(const int *js, int n, sigset_t *mask)
+{
+  int nfds = 0;
+  bool pidfds = true;
+
+  for (int i = 0; i < n; i++)
+    nfds += jobs[js[i]].nproc;
 
-    // TODO: Report job number, state, command and exit code or signal. */
+  int fds[nfds];
+  nfds = 0;
 
-    if ((which == FINISHED || which == ALL) && jobs[j].state == FINISHED)
+  for (int i = 0; i < n; i++)
+  {
+    job_t *job = &jobs[js[i]];
+    for (int p = 0; p < job->nproc; p++)
     {
-      printf("[%d]+  ", j);
-      printf("FINISHED              ");
-      printf("%s", jobs[j].command);
-      if (WIFEXITED(jobs[j].proc[0].exitcode))
-      {
-        printf("        exitcode: %d\n", WEXITSTATUS(jobs[j].proc[0].exitcode));
-      }
-      else // signaled
+      if (job->proc[p].state == FINISHED)
+        continue;
+      fds[nfds++] = job->proc[p].pidfd;
+      pidfds &= job->proc[p].pidfd >= 0;
+    }
+  }
+
+  if (nfds == 0)
+    return;
+
+  if (!pidfds)
+  {
+    waitevent(-1, mask);
+    return;
+  }
+
+  sigset_t blocked = *mask;
+  sigaddset(&blocked, SIGCHLD);
+  if (!waitevents(fds, nfds, &blocked))
+    return;
+
+  /* Let SIGCHLD handler bury the process. */
+  sigset_t saved;
+  Sigprocmask(SIG_SETMASK, mask, &saved);
+  Sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/* Sleep until background job 'j' or, if 'j' is negative, any of them has
+ * finished. Jobs stopped by the user are not waited for, but those paused or
+ * throttled by the shell will be continued, so they are. Finished job is
+ * deleted and its exit status returned through 'statusp'. Returns index of the
+ * job or -1 if there's nothing to wait for. */
+int waitjob(int j, int *statusp, sigset_t *mask)
+{
+  while (true)
+  {
+    int js[njobmax], n = 0;
+
+    adoptorphans();
+    for (int i = BG; i < njobmax; i++)
+    {
+      if (jobs[i].pgid == 0 || (j >= 0 && i != j))
+        continue;
+      if (jobs[i].state == STOPPED && !jobs[i].paused &&
+          !jobs[i].info->throttle_stopped)
+        continue;
+      if (jobs[i].state == FINISHED)
       {
-        printf("        signal: %d\n", WTERMSIG(jobs[j].proc[0].exitcode));
+        jobstate(i, statusp);
+        return i;
       }
-      deljob(&jobs[j]);
+      js[n++] = i;
+    }
+
+    if (n == 0)
+      return -1;
+    waitjobs(js, n, mask);
+  }
+}
+
+#define THROTTLE_PERIOD 100 /* [ms] */
+
+/* Throttled job runs for 'throttle' percent of each period and is stopped for
+ * the rest of it. Timer identifies the job by its pgid, as the job can be
+ * moved between slots. Job stopped by the user is left alone. */
+static void throttle_tick(int fd, void *arg)
+{
+  pid_t pgid = (intptr_t)arg;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = 0; j < njobmax; j++)
+  {
+    job_t *job = &jobs[j];
+    if (job->pgid != pgid || job->throttle_timer != fd)
+      continue;
+
+    long run = THROTTLE_PERIOD * job->throttle / 100;
+    if (job->state == STOPPED)
+    {
+      settimer(fd, THROTTLE_PERIOD, false);
+    }
+    else if (job->info->throttle_stopped)
+    {
+      signaljob(job, SIGCONT);
+      job->info->throttle_stopped = false;
+      settimer(fd, run, false);
+    }
+    else
+    {
+      signaljob(job, SIGSTOP);
+      job->info->throttle_stopped = true;
+      settimer(fd, THROTTLE_PERIOD - run, false);
     }
-    if ((which == RUNNING || which == ALL) && jobs[j].state == RUNNING)
+    break;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Let the job use CPU only 'percent' of the time. 0 or 100 turns it off. */
+bool throttlejob(int j, int percent)
+{
+  if (j < BG || j >= njobmax || jobs[j].state == FINISHED)
+    return false;
+
+  job_t *job = &jobs[j];
+
+  if (percent <= 0 || percent >= 100)
+  {
+    if (job->throttle_timer >= 0)
+      deltimer(job->throttle_timer);
+    if (job->info->throttle_stopped)
+      signaljob(job, SIGCONT);
+    job->throttle = 0;
+    job->throttle_timer = -1;
+    job->info->throttle_stopped = false;
+    return true;
+  }
+
+  job->throttle = percent;
+  if (job->throttle_timer < 0)
+    job->throttle_timer = addtimer(THROTTLE_PERIOD * percent / 100, false,
+                                   throttle_tick, (void *)(intptr_t)job->pgid);
+  return true;
+}
+
+#define TIMEOUT_GRACE 2000 /* [ms] */
+
+/* Job that runs out of time gets SIGTERM, and SIGKILL if it's still alive
+ * 'TIMEOUT_GRACE' later. Timer identifies the job by its pgid, just like
+ * throttle timer does. */
+static void timeout_tick(int fd, void *arg)
+{
+  pid_t pgid = (intptr_t)arg;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = 0; j < njobmax; j++)
+  {
+    job_t *job = &jobs[j];
+    if (job->pgid != pgid || job->info->timeout_timer != fd)
+      continue;
+
+    if (job->info->timedout)
     {
-      printf("[%d]+  ", j);
-      printf("RUNNING               ");
-      printf("%s\n", jobs[j].command);
+      debug("[%d] killing '%s'\n", j, mkcommand(job));
+      signaljob(job, SIGKILL);
+      settimer(fd, 0, false);
     }
-    if ((which == STOPPED || which == ALL) && jobs[j].state == STOPPED)
+    else
     {
-      printf("[%d]+  ", j);
-      printf("STOPPED               ");
-      printf("%s\n", jobs[j].command);
+      debug("[%d] '%s' timed out\n", j, mkcommand(job));
+      job->info->timedout = true;
+      signaljob(job, SIGTERM);
+      signaljob(job, SIGCONT);
+      settimer(fd, TIMEOUT_GRACE, false);
     }
+    break;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Terminate the job if it does not finish in 'msec' milliseconds. */
+void timeoutjob(int j, long msec)
+{
+  assert(j < njobmax);
+  job_t *job = &jobs[j];
+
+  job->info->timeout_timer = addtimer(msec, false, timeout_tick,
+                                (void *)(intptr_t)job->pgid);
+}
+
+/* Kill the job by sending it a SIGTERM. */
+bool killjob(int j)
+{
+  /* Job whose processes have just finished may have left some behind. */
+  adoptorphans();
+  if (j >= njobmax || jobs[j].state == FINISHED)
+    return false;
+  debug("[%d] killing '%s'\n", j, mkcommand(&jobs[j]));
+
+  // TODO: I love the smell of napalm in the morning. */
+
+  if (jobs[j].state == STOPPED || jobs[j].info->throttle_stopped)
+    signaljob(&jobs[j], SIGCONT);
+  signaljob(&jobs[j], SIGTERM);
+
+  return true;
+}
+
+static const char *statename(int state)
+{
+  return state == RUNNING ? "RUNNING" : state == STOPPED ? "STOPPED" : "FINISHED";
+}
+
+/* Print state, exit status and resource usage of each process of a job. */
+static void showprocs(FILE *out, job_t *job)
+{
+  for (int i = 0; i < job->nproc; i++)
+  {
+    proc_t *proc = &job->proc[i];
+    fprintf(out, "    %8d  %-8s  ", proc->pid, statename(proc->state));
+    if (proc->state != FINISHED)
+      fprintf(out, "%-12s  ", "");
+    else if (WIFEXITED(proc->exitcode))
+      fprintf(out, "exitcode: %-3d  ", WEXITSTATUS(proc->exitcode));
+    else
+      fprintf(out, "signal: %-5d  ", WTERMSIG(proc->exitcode));
+    procinfo_t *info = &job->info->procs[i];
+    showusage(out, proc->state, info);
+    if (memcmp(&info->limits, &(limits_t){0}, sizeof(limits_t)))
+    {
+      fprintf(out, "%24s limits:", "");
+      showlimits(out, &info->limits);
+      fprintf(out, "\n");
+    }
+  }
+}
+
+static void showjob(FILE *out, int j, int format)
+{
+  job_t *job = &jobs[j];
+
+  jobref_t *current = TAILQ_FIRST(&mrujobs);
+  char mark = ' ';
+  if (&job->info->ref == current)
+    mark = '+';
+  else if (current && &job->info->ref == TAILQ_NEXT(current, mru))
+    mark = '-';
+
+  fprintf(out, "[%d]%c  %-22s%s", j, mark, statename(job->state),
+          mkcommand(job));
+  if (job->state == FINISHED)
+  {
+    fprintf(out, "        ");
+    if (job->info->timedout)
+      fprintf(out, "timed out, ");
+    int status = exitcode(job);
+    if (WIFEXITED(status))
+      fprintf(out, "exitcode: %d", WEXITSTATUS(status));
+    else
+      fprintf(out, "signal: %d", WTERMSIG(status));
+  }
+  else
+  {
+    if (job->throttle)
+      fprintf(out, "        throttle: %d%%", job->throttle);
+    if (job->info->timedout)
+      fprintf(out, "        timed out");
+  }
+  fprintf(out, "\n");
+  if (format == JOBS_LONG)
+    showprocs(out, job);
+}
+
+static void showstring(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < ' ')
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void showstatus(FILE *out, int status)
+{
+  if (WIFEXITED(status))
+    fprintf(out, ", \"exitcode\": %d", WEXITSTATUS(status));
+  else
+    fprintf(out, ", \"signal\": %d", WTERMSIG(status));
+}
+
+/* One JSON object per job, with states and exit statuses of processes. */
+static void showjson(FILE *out, int j)
+{
+  job_t *job = &jobs[j];
+
+  fprintf(out, "{\"job\": %d, \"pgid\": %d, \"state\": \"%s\", \"command\": ",
+          j, job->pgid, statename(job->state));
+  showstring(out, mkcommand(job));
+  if (job->state == FINISHED)
+    showstatus(out, exitcode(job));
+  fprintf(out, ", \"throttle\": %d, \"timedout\": %s, \"procs\": [",
+          job->throttle, job->info->timedout ? "true" : "false");
+  for (int i = 0; i < job->nproc; i++)
+  {
+    proc_t *proc = &job->proc[i];
+    fprintf(out, "%s{\"pid\": %d, \"state\": \"%s\"", i ? ", " : "",
+            proc->pid, statename(proc->state));
+    if (proc->state == FINISHED)
+      showstatus(out, proc->exitcode);
+    fprintf(out, "}");
+  }
+  fprintf(out, "]}");
+}
+
+/* Report state of requested background jobs. Clean up finished jobs. The
+ * report is rendered in memory first and written out at once. */
+void watchjobs(int which, int format)
+{
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buf, &size);
+  int n = 0;
+
+  adoptorphans();
+  for (int j = BG; j < njobmax; j++)
+  {
+    job_t *job = &jobs[j];
+    if (job->pgid == 0 || (which != ALL && which != job->state))
+      continue;
+
+    if (format == JOBS_PGIDS)
+      fprintf(out, "%d\n", job->pgid);
+    else if (format == JOBS_JSON)
+    {
+      fprintf(out, n ? ",\n  " : "[\n  ");
+      showjson(out, j);
+    }
+    else
+      showjob(out, j, format);
+    n++;
+
+    if (job->state == FINISHED)
+      deljob(job);
+  }
+  if (format == JOBS_JSON)
+    fprintf(out, n ? "\n]\n" : "[]\n");
+  fclose(out);
+
+  fflush(stdout);
+  if (size > 0)
+    Write(STDOUT_FILENO, buf, size);
+  free(buf);
+}
+
+/* Returns true if some background job is still running or stopped. */
+bool jobs_p(void)
+{
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state != FINISHED)
+      return true;
+  return false;
+}
+
+/* Returns true if some background job has finished and is waiting to be
+ * reported by 'watchjobs'. */
+bool finished_p(void)
+{
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state == FINISHED)
+      return true;
+  return false;
+}
+
+/* Nice value process 'p' of the job was started with. */
+static int procnice(job_t *job, int p)
+{
+  limits_t *limits = &job->info->procs[p].limits;
+  return limits->renice ? limits->nice : shell_nice;
+}
+
+/* Returns true if all processes of the job were started with the same nice
+ * value, so their priority can be changed for the whole process group. That
+ * covers also their descendants, which aren't known to the shell. */
+static bool samenice_p(job_t *job)
+{
+  for (int i = 1; i < job->nproc; i++)
+    if (procnice(job, i) != procnice(job, 0))
+      return false;
+  return true;
+}
+
+/* Lower or restore priority of a job, see 'demoteprio'. Without job control
+ * the job has no process group of its own. */
+static bool prioritizejob(job_t *job, bool demote)
+{
+  if (job->nproc == 0)
+    return false;
+
+  if (jobcontrol_p() && samenice_p(job))
+  {
+    int nice = procnice(job, 0);
+    if (demote)
+      return demoteprio(job->pgid, true, nice, shell_ioprio);
+    restoreprio(job->pgid, true, nice, shell_ioprio);
+    return false;
+  }
+
+  bool demoted = false;
+  for (int i = 0; i < job->nproc; i++)
+  {
+    proc_t *proc = &job->proc[i];
+    if (proc->state == FINISHED)
+      continue;
+    if (demote)
+      demoted |= demoteprio(proc->pid, false, procnice(job, i), shell_ioprio);
+    else
+      restoreprio(proc->pid, false, procnice(job, i), shell_ioprio);
+  }
+  return demoted;
+}
+
+/* Background jobs may get lower priority while foreground job runs. */
+static void demotejobs(bool fg)
+{
+  for (int j = BG; j < njobmax; j++)
+  {
+    job_t *job = &jobs[j];
+    if (job->pgid == 0 || job->demoted == fg)
+      continue;
+    job->demoted = prioritizejob(job, fg);
   }
 }
 
 /* Monitor job execution. If it gets stopped move it to background.
- * When a job has finished or has been stopped move shell to foreground. */
+ * When a job has finished or has been stopped move shell to foreground.
+ * Returns exit code the way 'wait' does, or 128 + SIGTSTP if stopped. */
 int monitorjob(sigset_t *mask)
 {
-  int exitcode, state;
+  int exitcode, state = RUNNING;
 
   // TODO: Following code requires use of Tcsetpgrp of tty_fd. */
 
-  Tcsetpgrp(tty_fd, jobs[0].pgid);
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, jobs[0].pgid);
+  demotejobs(true);
 
   int job_state;
 
   while (true)
   {
+    if (jobs[0].state == FINISHED && jobs[0].info->timedout)
+      printf("timed out '%s'\n", mkcommand(&jobs[0]));
     job_state = jobstate(0, &exitcode);
-    if (job_state != RUNNING)
+    /* Without job control stopped job can't be put in the background. It
+     * gets continued along with the shell, so keep waiting for it. */
+    if (job_state != RUNNING && (job_state != STOPPED || jobcontrol_p()))
+    {
+      break;
+    }
+    /* Job has finished, but left adopted processes behind. */
+    if (orphaned_p(&jobs[0], &exitcode))
     {
+      state = FINISHED;
       break;
     }
-    Sigsuspend(mask);
+    waitevent(-1, mask);
   }
 
   int candidate = allocjob();
   jobs[candidate].pgid = 0;
   movejob(FG, candidate);
+  if (jobs[candidate].pgid)
+    linkjob(&jobs[candidate]);
 
   if (job_state == STOPPED)
   {
-    printf("[%d] suspended '%s' \n", candidate, jobs[candidate].command);
+    printf("[%d] suspended '%s' \n", candidate, mkcommand(&jobs[candidate]));
+    exitcode = W_STOPCODE(SIGTSTP);
+  }
+  if (state == FINISHED)
+  {
+    printf("[%d] left running '%s' \n", candidate, mkcommand(&jobs[candidate]));
   }
 
-  Tcsetpgrp(tty_fd, getpgrp());
+  demotejobs(false);
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, getpgrp());
 
-  return exitcode;
+  if (WIFEXITED(exitcode))
+    return WEXITSTATUS(exitcode);
+  return 128 + (WIFSIGNALED(exitcode) ? WTERMSIG(exitcode) : WSTOPSIG(exitcode));
 }
 
-/* Called just at the beginning of shell's life. */
-void initjobs(void)
+/* Returns true if there's a foreground job. Safe to call from signal
+ * handler. */
+bool fgjob_p(void)
+{
+  return jobs && jobs[0].pgid != 0;
+}
+
+/* Called just at the beginning of shell's life. Shell that is not
+ * 'interactive' does not touch the terminal at all. */
+void initjobs(bool interactive)
 {
   Signal(SIGCHLD, sigchld_handler);
   jobs = calloc(sizeof(job_t), 1);
 
-  // Assume we're running in interactive mode, so move us to foreground.
-  // Duplicate terminal fd, but do not leak it to subprocesses that execve. */
-  assert(isatty(STDIN_FILENO));
-  tty_fd = Dup(STDIN_FILENO);
-  fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
+  if (interactive)
+  {
+    // Assume we're running in interactive mode, so move us to foreground.
+    // Duplicate terminal fd, but do not leak it to subprocesses that execve. */
+    assert(isatty(STDIN_FILENO));
+    tty_fd = Dup(STDIN_FILENO);
+    fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
 
-  /* Take control of the terminal. */
-  Tcsetpgrp(tty_fd, getpgrp());
+    /* Take control of the terminal. */
+    Tcsetpgrp(tty_fd, getpgrp());
 
-  /* Save default terminal attributes for the shell. */
-  Tcgetattr(tty_fd, &shell_tmodes);
+    /* Save default terminal attributes for the shell. */
+    Tcgetattr(tty_fd, &shell_tmodes);
+  }
+
+  /* Jobs inherit scheduling priorities from the shell. */
+  shell_nice = getpriority(PRIO_PROCESS, 0);
+  shell_ioprio = getioprio();
 }
 
-/* Called just before the shell finishes. */
-void shutdownjobs(void)
+/* Shell with job control must not be stopped by the terminal. */
+void ignorestops(void)
+{
+  Signal(SIGTSTP, SIG_IGN);
+  Signal(SIGTTIN, SIG_IGN);
+  Signal(SIGTTOU, SIG_IGN);
+}
+
+/* Interactive shell ignores terminal stop signals for itself, see
+ * 'ignorestops', and server ignores SIGPIPE, see 'serve'. Every process the shell starts,
+ * forked or replacing the shell by execve, gets them back to defaults before
+ * execve. */
+void defaultsignals(void)
+{
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+  Signal(SIGPIPE, SIG_DFL);
+}
+
+static void shutdown_tick(int fd __unused, void *arg)
+{
+  *(bool *)arg = true;
+}
+
+/* Called just before the shell finishes. All jobs get terminated at once and
+ * have 'grace' milliseconds in total to finish. Those still alive after that
+ * get killed, so the shell exits in bounded time and leaves nothing behind. */
+void shutdownjobs(long grace)
 {
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
-  // TODO: Kill remaining jobs and wait for them to finish. */
+  /* Neither pressure policy nor throttling may stop jobs anymore. */
+  pausepressure(false);
+  adoptorphans();
 
+  int njobs = 0, nkilled = 0;
   for (int j = BG; j < njobmax; j++)
   {
+    if (jobs[j].pgid == 0 || jobs[j].state == FINISHED)
+      continue;
+    throttlejob(j, 0);
+    signaljob(&jobs[j], SIGTERM);
+    signaljob(&jobs[j], SIGCONT);
+    njobs++;
+  }
 
-    Tcsetpgrp(tty_fd, jobs[j].pgid);
+  bool expired = grace <= 0;
+  int timer = expired ? -1 : addtimer(grace, false, shutdown_tick, &expired);
 
-    if (jobs[j].pgid != 0)
-    {
-      killjob(j);
-      printf("[%d] exited '%s', status=%d\n", j, jobs[j].command, jobs[j].state);
-    }
-    Tcsetpgrp(tty_fd, getpgrp());
+  while (!expired)
+  {
+    int js[njobmax], n = 0;
+    adoptorphans();
+    for (int j = BG; j < njobmax; j++)
+      if (jobs[j].pgid != 0 && jobs[j].state != FINISHED)
+        js[n++] = j;
+    if (n == 0)
+      break;
+    waitjobs(js, n, &mask);
   }
 
-  watchjobs(FINISHED);
+  if (timer >= 0)
+    deltimer(timer);
+
+  /* Killed processes get buried by init after we're gone. */
+  for (int j = BG; j < njobmax; j++)
+  {
+    if (jobs[j].pgid == 0 || jobs[j].state == FINISHED)
+      continue;
+    signaljob(&jobs[j], SIGKILL);
+    nkilled++;
+  }
+
+  if (njobs > 0)
+    printf("shutdown: %d job(s) terminated, %d of them killed\n", njobs,
+           nkilled);
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
-  Close(tty_fd);
+  if (tty_fd >= 0)
+    Close(tty_fd);
+}
+
+/* Forget all jobs in a child process that goes on as a shell of its own.
+ * Jobs belong to the parent, so they're neither signalled nor waited for.
+ * Their memory is just left behind. */
+void resetjobs(void)
+{
+  /* Zygote's children come from before the table was made. */
+  for (int j = 0; jobs && j < njobmax; j++)
+  {
+    job_t *job = &jobs[j];
+    for (int i = 0; i < job->nproc; i++)
+      if (job->proc[i].pidfd >= 0)
+        Close(job->proc[i].pidfd);
+    if (job->info && job->info->gate >= 0)
+      Close(job->info->gate);
+  }
+
+  njobmax = 1;
+  lastbg = -1;
+  TAILQ_INIT(&mrujobs);
+  RB_INIT(&namedjobs);
+  subreaper = false;
+  orphans = false;
+
+  if (tty_fd >= 0)
+  {
+    Close(tty_fd);
+    tty_fd = -1;
+  }
+  initjobs(false);
 }
@@ -0,0 +1,145 @@
+#include "shell.h"
+
+/* GNU make jobserver is a pipe (or a named fifo) filled with tokens. Anyone
+ * who wants to start a job takes a token out and puts it back when the job
+ * is done, so nested makes and shell's background jobs share one budget. */
+
+static int js_read = -1;  /* non-blocking read end of jobserver pipe */
+static int js_write = -1; /* write end of jobserver pipe */
+static int js_pipe = -1;  /* read end of the pipe if we're the jobserver */
+
+static void closejobserver(void)
+{
+  if (js_read >= 0)
+    Close(js_read);
+  if (js_write >= 0)
+    Close(js_write);
+  if (js_pipe >= 0)
+    Close(js_pipe);
+  js_read = js_write = js_pipe = -1;
+}
+
+/* Open read end once more as independent file description, so it can be made
+ * non-blocking without affecting other processes sharing the pipe. */
+static int openread(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    debug("jobserver: cannot open '%s': %s\n", path, strerror(errno));
+  return fd;
+}
+
+/* Join jobserver advertised by make through MAKEFLAGS, if there's one. */
+void initjobserver(void)
+{
+  const char *flags = getenv("MAKEFLAGS");
+  const char *auth = NULL;
+  const char *opt;
+  char path[PATH_MAX];
+  int rfd, wfd;
+
+  if (!flags)
+    return;
+
+  /* Last option wins, and older makes call it '--jobserver-fds'. */
+  for (opt = flags; (opt = strstr(opt, "--jobserver-")); opt++)
+    if (!strncmp(opt, "--jobserver-auth=", 17))
+      auth = opt + 17;
+    else if (!strncmp(opt, "--jobserver-fds=", 16))
+      auth = opt + 16;
+
+  if (!auth)
+    return;
+
+  if (!strncmp(auth, "fifo:", 5))
+  {
+    size_t len = min(strcspn(auth + 5, " "), sizeof(path) - 1);
+    memcpy(path, auth + 5, len);
+    path[len] = '\0';
+    if ((js_read = openread(path)) < 0)
+      return;
+    if ((js_write = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+      closejobserver();
+  }
+  else if (sscanf(auth, "%d,%d", &rfd, &wfd) == 2)
+  {
+    /* Make doesn't pass its pipe to commands not marked as recursive. */
+    if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0)
+      return;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", rfd);
+    if ((js_read = openread(path)) < 0)
+      return;
+    js_write = wfd;
+  }
+}
+
+/* Become jobserver with 'n' slots and advertise it to subprocesses.
+ * Shell holds one of them implicitly for its foreground job. */
+void mkjobserver(int n)
+{
+  int fds[2];
+  char path[PATH_MAX];
+  char flags[64];
+
+  closejobserver();
+
+  Pipe(fds);
+  for (int i = 1; i < n; i++)
+    Write(fds[1], "+", 1);
+
+  /* Pipe ends are inherited by subprocesses, while shell reads its tokens
+   * through private non-blocking descriptor. */
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[0]);
+  js_read = openread(path);
+  js_write = fds[1];
+  js_pipe = fds[0];
+
+  snprintf(flags, sizeof(flags), " -j%d --jobserver-auth=%d,%d", n, fds[0],
+           fds[1]);
+  setenv("MAKEFLAGS", flags, 1);
+}
+
+/* Returns true if the shell is a jobserver or a client of one. */
+bool jobserver_p(void)
+{
+  return js_read >= 0;
+}
+
+/* Take token out of jobserver and store it under 'tokp'. If 'block' is set
+ * then sleep until a token is available. Returns 1 if a token was acquired,
+ * 0 if there's no jobserver and -1 if no token is available right now. */
+int gettoken(char *tokp, bool block)
+{
+  if (js_read < 0)
+    return 0;
+
+  while (true)
+  {
+    ssize_t n = read(js_read, tokp, 1);
+    if (n == 1)
+      return 1;
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+      /* Jobserver is gone. Do not throttle anymore. */
+      closejobserver();
+      return 0;
+    }
+    if (!block)
+      return -1;
+
+    /* SIGCHLD handler puts tokens of finished jobs back into the pipe, so
+     * let it run while we sleep, even if the caller has blocked it. Otherwise
+     * we'd never wake up when our own jobs hold all tokens. */
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    waitevent(js_read, &mask);
+  }
+}
+
+/* Return tokens to jobserver. Called from SIGCHLD handler. */
+void puttokens(const char *tokens, int n)
+{
+  if (js_write >= 0 && n > 0)
+    (void)write(js_write, tokens, n);
+}
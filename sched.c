@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "shell.h"
+
+/* Pressure stall information (PSI) tells which share of last 10 seconds tasks
+ * spent waiting for CPU, memory or I/O. When it exceeds configured threshold
+ * background jobs are not started and, if requested, the youngest ones are
+ * stopped one at a time until the pressure drops. */
+
+enum { PSI_CPU, PSI_MEMORY, PSI_IO, PSI_NUM };
+
+static const char *psi_name[PSI_NUM] = {"cpu", "memory", "io"};
+static double psi_limit[PSI_NUM]; /* 'some avg10' thresholds, 0 if unset */
+static bool psi_pause = false;    /* stop youngest jobs when overloaded */
+static int psi_timer = -1;        /* periodic pressure check */
+
+#define PSI_PERIOD 1000 /* [ms] */
+
+/* Returns 'some avg10' value of a resource as percentage. */
+static double readpressure(int r)
+{
+  char path[32], buf[128];
+  double avg = 0.0;
+
+  snprintf(path, sizeof(path), "/proc/pressure/%s", psi_name[r]);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return avg;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  Close(fd);
+
+  if (n > 0)
+  {
+    buf[n] = '\0';
+    sscanf(buf, "some avg10=%lf", &avg);
+  }
+  return avg;
+}
+
+static bool overloaded(void)
+{
+  for (int r = 0; r < PSI_NUM; r++)
+    if (psi_limit[r] > 0 && readpressure(r) >= psi_limit[r])
+      return true;
+  return false;
+}
+
+static void pressure_tick(int fd __unused, void *arg __unused)
+{
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  if (!overloaded())
+    unpausejob(&mask);
+  else if (psi_pause)
+    pausejob();
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Set threshold for resource pressure. Zero turns it off.
+ * Returns false if resource name is not known. */
+bool setpressure(const char *name, double limit)
+{
+  int r;
+  for (r = 0; r < PSI_NUM && strcmp(name, psi_name[r]); r++)
+    continue;
+  if (r == PSI_NUM)
+    return false;
+  psi_limit[r] = limit;
+
+  bool active = false;
+  for (r = 0; r < PSI_NUM; r++)
+    active |= psi_limit[r] > 0;
+
+  if (active && psi_timer < 0)
+  {
+    psi_timer = addtimer(PSI_PERIOD, true, pressure_tick, NULL);
+  }
+  else if (!active && psi_timer >= 0)
+  {
+    deltimer(psi_timer);
+    psi_timer = -1;
+    pausepressure(false);
+  }
+  return true;
+}
+
+/* Turn pressure checks off in a child process. Its timer is dropped with
+ * other event sources by 'resetevents'. */
+void resetpressure(void)
+{
+  for (int r = 0; r < PSI_NUM; r++)
+    psi_limit[r] = 0;
+  psi_pause = false;
+  psi_timer = -1;
+}
+
+/* Enable or disable stopping of background jobs under pressure. */
+void pausepressure(bool enable)
+{
+  psi_pause = enable;
+  if (enable)
+    return;
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  while (unpausejob(&mask))
+    continue;
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+void showpressure(void)
+{
+  for (int r = 0; r < PSI_NUM; r++)
+  {
+    printf("%-8s %6.2f%%", psi_name[r], readpressure(r));
+    if (psi_limit[r] > 0)
+      printf("  limit: %.2f%%", psi_limit[r]);
+    printf("\n");
+  }
+  if (psi_pause)
+    printf("background jobs are stopped when limit is exceeded\n");
+}
+
+/* Called before background job starts. Sleep until pressure drops. */
+void admitjob(void)
+{
+  if (psi_timer < 0 || !overloaded())
+    return;
+
+  msg("pressure: delaying job until pressure drops\n");
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  do
+    waitevent(-1, &mask);
+  while (overloaded());
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* While a foreground job holds the terminal, background jobs get their nice
+ * value raised and possibly I/O priority lowered to idle class. Priorities
+ * are always computed from values recorded in job table when the job
+ * started, so repeated demotions do not accumulate. */
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static int bg_nice = 0;        /* nice increment of background jobs */
+static bool bg_idleio = false; /* move background jobs to idle I/O class */
+
+void setbgnice(int incr, bool idleio)
+{
+  bg_nice = incr;
+  bg_idleio = idleio;
+
+  /* Only privileged users may lower nice value back. */
+  struct rlimit rl;
+  getrlimit(RLIMIT_NICE, &rl);
+  if (incr > 0 && geteuid() != 0 && rl.rlim_cur < RLIM_INFINITY &&
+      20 - (long)rl.rlim_cur > getpriority(PRIO_PROCESS, 0))
+    msg("bgnice: warning: RLIMIT_NICE does not permit restoring priority\n");
+}
+
+void showbgnice(void)
+{
+  if (bg_nice == 0 && !bg_idleio)
+    printf("bgnice: off\n");
+  else
+    printf("bgnice: +%d%s\n", bg_nice, bg_idleio ? " idle I/O" : "");
+}
+
+int getioprio(void)
+{
+  return syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+}
+
+/* Lower priority of background process group (or single process if 'group'
+ * is not set) relative to 'nice' & 'ioprio' it was started with. Returns
+ * false if the policy is off. */
+bool demoteprio(pid_t id, bool group, int nice, int ioprio)
+{
+  if (bg_nice == 0 && !bg_idleio)
+    return false;
+  if (bg_nice)
+    (void)setpriority(group ? PRIO_PGRP : PRIO_PROCESS, id,
+                      min(nice + bg_nice, 19));
+  if (bg_idleio)
+    (void)syscall(SYS_ioprio_set, group ? IOPRIO_WHO_PGRP : IOPRIO_WHO_PROCESS,
+                  id, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+  return true;
+}
+
+/* Undo 'demoteprio'. */
+void restoreprio(pid_t id, bool group, int nice, int ioprio)
+{
+  if (setpriority(group ? PRIO_PGRP : PRIO_PROCESS, id, nice) < 0)
+    debug("bgnice: cannot restore priority of %d: %s\n", id, strerror(errno));
+  (void)syscall(SYS_ioprio_set, group ? IOPRIO_WHO_PGRP : IOPRIO_WHO_PROCESS,
+                id, ioprio);
+}
+
+/* Processes of a job can be confined with 'limit' modifier. Limits are set in
+ * a child process between fork and execve, so no wrapper process is needed. */
+
+/* Parse size with optional K, M or G suffix. */
+static bool parsesize(const char *s, rlim_t *sizep)
+{
+  char *end;
+  unsigned long long size = strtoull(s, &end, 10);
+
+  if (end == s)
+    return false;
+  switch (toupper(*end))
+  {
+    case 'G':
+      size <<= 10;
+      /* FALLTHROUGH */
+    case 'M':
+      size <<= 10;
+      /* FALLTHROUGH */
+    case 'K':
+      size <<= 10;
+      end++;
+  }
+  *sizep = size;
+  return *end == '\0';
+}
+
+/* Parse list of CPUs like '0-3,6'. */
+static bool parsecpus(const char *s, bitstr_t *cpus)
+{
+  bit_nclear(cpus, 0, MAXCPUS - 1);
+
+  do
+  {
+    char *end;
+    long first = strtol(s, &end, 10), last = first;
+    if (end == s)
+      return false;
+    if (*end == '-')
+    {
+      s = end + 1;
+      last = strtol(s, &end, 10);
+      if (end == s)
+        return false;
+    }
+    if (first < 0 || first > last || last >= MAXCPUS)
+      return false;
+    bit_nset(cpus, first, last);
+    s = end;
+  } while (*s++ == ',');
+
+  return s[-1] == '\0';
+}
+
+/* Parse 'key=value' limit specification. Known keys are: mem (address space
+ * size), time (CPU seconds), nofile (open files), nice and cpu (CPU list). */
+bool parselimit(limits_t *limits, char *spec)
+{
+  char *value = index(spec, '=');
+  if (!value)
+    return false;
+  *value++ = '\0';
+
+  bool ok = false;
+  if (!strcmp(spec, "mem"))
+    ok = parsesize(value, &limits->mem) && limits->mem > 0;
+  else if (!strcmp(spec, "time"))
+    ok = parsesize(value, &limits->cputime) && limits->cputime > 0;
+  else if (!strcmp(spec, "nofile"))
+    ok = parsesize(value, &limits->nofile) && limits->nofile > 0;
+  else if (!strcmp(spec, "nice"))
+  {
+    char *end;
+    limits->nice = strtol(value, &end, 10);
+    ok = limits->renice = *end == '\0' && end != value;
+  }
+  else if (!strcmp(spec, "cpu"))
+    ok = limits->affinity = parsecpus(value, limits->cpus);
+
+  value[-1] = '=';
+  return ok;
+}
+
+static void setlimit(int resource, rlim_t limit, const char *name)
+{
+  struct rlimit rl = {.rlim_cur = limit, .rlim_max = limit};
+  if (setrlimit(resource, &rl) < 0)
+    unix_error("limit: %s", name);
+}
+
+/* Called in a child process just before it executes a command. */
+void applylimits(const limits_t *limits)
+{
+  if (limits->mem)
+    setlimit(RLIMIT_AS, limits->mem, "mem");
+  if (limits->cputime)
+    setlimit(RLIMIT_CPU, limits->cputime, "time");
+  if (limits->nofile)
+    setlimit(RLIMIT_NOFILE, limits->nofile, "nofile");
+
+  if (limits->renice && setpriority(PRIO_PROCESS, 0, limits->nice) < 0)
+    unix_error("limit: nice");
+
+  if (limits->affinity)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < min(MAXCPUS, CPU_SETSIZE); cpu++)
+      if (bit_test(limits->cpus, cpu))
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+      unix_error("limit: cpu");
+  }
+}
+
+void showlimits(FILE *out, const limits_t *limits)
+{
+  if (limits->mem)
+    fprintf(out, " mem=%lluK", (unsigned long long)limits->mem >> 10);
+  if (limits->cputime)
+    fprintf(out, " time=%llu", (unsigned long long)limits->cputime);
+  if (limits->nofile)
+    fprintf(out, " nofile=%llu", (unsigned long long)limits->nofile);
+  if (limits->renice)
+    fprintf(out, " nice=%d", limits->nice);
+  if (limits->affinity)
+  {
+    const char *sep = " cpu=";
+    for (int cpu = 0; cpu < MAXCPUS; cpu++)
+    {
+      if (!bit_test(limits->cpus, cpu))
+        continue;
+      int last = cpu;
+      while (last + 1 < MAXCPUS && bit_test(limits->cpus, last + 1))
+        last++;
+      if (last > cpu)
+        fprintf(out, "%s%d-%d", sep, cpu, last);
+      else
+        fprintf(out, "%s%d", sep, cpu);
+      sep = ",";
+      cpu = last;
+    }
+  }
+}
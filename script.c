@@ -0,0 +1,221 @@
+#include <stdio_ext.h>
+
+#include "shell.h"
+#include "rio.h"
+
+/* Non-interactive shell runs commands from a script file, a '-c' string or
+ * its standard input, one line at a time. Regular files get mapped into
+ * memory at once, anything else (pipes, terminals) is read through a rio
+ * buffer. Empty lines and lines starting with '#' are skipped.
+ *
+ * Last command of a script or a string doesn't have to be forked, as the
+ * shell has nothing else to do. It's only known to be the last one when the
+ * whole text is at hand, so input read with rio never gets executed so.
+ *
+ * Executable file without '#!' line makes execve fail with ENOEXEC. Child
+ * process that tried to run it is a copy of the shell already, so instead of
+ * executing another shell it drops what it inherited and reads the file. */
+
+typedef struct
+{
+  const char *text; /* mapped file or string, NULL if reading with rio */
+  size_t size;      /* length of text */
+  size_t pos;       /* where next line starts */
+  bool mapped;      /* text has to be unmapped */
+  rio_t *rio;       /* buffered reader of a non-mappable file */
+  bool tailcall;    /* last command may replace the shell */
+} reader_t;
+
+static volatile sig_atomic_t interrupted = false;
+
+static void openreader(reader_t *r, int fd)
+{
+  struct stat st;
+  Fstat(fd, &st);
+
+  *r = (reader_t){.text = NULL};
+  if (S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    r->size = st.st_size;
+    r->text = Mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    r->mapped = true;
+    Madvise((void *)r->text, r->size, MADV_SEQUENTIAL);
+  }
+  else if (!S_ISREG(st.st_mode))
+  {
+    r->rio = malloc(sizeof(rio_t));
+    rio_readinitb(r->rio, fd);
+  }
+}
+
+static void closereader(reader_t *r)
+{
+  if (r->mapped)
+    Munmap((void *)r->text, r->size);
+  free(r->rio);
+}
+
+/* Returns next line without the newline, or NULL at end of input.
+ * Line is allocated, since 'eval' tokenizes it in place. */
+static char *nextline(reader_t *r)
+{
+  if (!r->rio)
+  {
+    if (r->pos >= r->size)
+      return NULL;
+    const char *s = r->text + r->pos;
+    const char *nl = memchr(s, '\n', r->size - r->pos);
+    size_t len = nl ? (size_t)(nl - s) : r->size - r->pos;
+    r->pos += len + 1;
+    return strndup(s, len);
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  do
+  {
+    line = realloc(line, len + RIO_BUFSIZE);
+    n = rio_readlineb(r->rio, line + len, RIO_BUFSIZE);
+    if (n < 0)
+      msg("shell: read error: %s\n", strerror(errno));
+    if (n <= 0)
+      break;
+    len += n;
+  } while (line[len - 1] != '\n');
+
+  if (len == 0)
+  {
+    free(line);
+    return NULL;
+  }
+  if (line[len - 1] == '\n')
+    len--;
+  line[len] = '\0';
+  return line;
+}
+
+/* Returns true if there's a command line past current position. */
+static bool morecmds_p(reader_t *r)
+{
+  for (size_t pos = r->pos; pos < r->size; pos++)
+  {
+    /* Mapped text is not NUL-terminated. */
+    while (pos < r->size && (r->text[pos] == ' ' || r->text[pos] == '\t'))
+      pos++;
+    if (pos < r->size && r->text[pos] != '\n' && r->text[pos] != '#')
+      return true;
+    const char *nl = memchr(r->text + pos, '\n', r->size - pos);
+    if (!nl)
+      break;
+    pos = nl - r->text;
+  }
+  return false;
+}
+
+/* Shell must stay around if there are jobs to watch or orphans to adopt. */
+static bool tailcall_p(reader_t *r)
+{
+  return r->tailcall && !r->rio && !morecmds_p(r) && !jobs_p() &&
+         !subreaper_p();
+}
+
+static int runlines(reader_t *r)
+{
+  int exitcode = 0;
+  char *line;
+
+  while (!interrupted && (line = nextline(r)))
+  {
+    char *cmd = line + strspn(line, " \t");
+    if (*cmd && *cmd != '#')
+      exitcode = tailcall_p(r) ? evallast(cmd) : eval(cmd, false);
+    free(line);
+  }
+  return exitcode;
+}
+
+/* Run commands read from 'fd'. If 'tailcall' is set, the last command may
+ * replace the shell. Returns exit code of the last one. */
+int runscript(int fd, bool tailcall)
+{
+  reader_t r;
+  openreader(&r, fd);
+  r.tailcall = tailcall;
+  int exitcode = runlines(&r);
+  closereader(&r);
+  return exitcode;
+}
+
+/* Same as above for commands given as a string. */
+int runstring(const char *text)
+{
+  reader_t r = {.text = text, .size = strlen(text), .tailcall = true};
+  return runlines(&r);
+}
+
+/* Text files don't have NUL characters in their first line. */
+static bool binary_p(int fd)
+{
+  char buf[128];
+  ssize_t n = pread(fd, buf, sizeof(buf), 0);
+  if (n <= 0)
+    return false;
+  char *nl = memchr(buf, '\n', n);
+  return memchr(buf, '\0', nl ? nl - buf : n) != NULL;
+}
+
+/* Run 'path' as a script in a child process where execve failed with
+ * ENOEXEC. Jobs, timers, coprocesses and zygote belong to the parent shell,
+ * so they're forgotten before the first command runs. */
+noreturn void runfile(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    msg("%s: %s\n", path, strerror(errno));
+    exit(126);
+  }
+  if (binary_p(fd))
+  {
+    msg("%s: cannot execute binary file\n", path);
+    exit(126);
+  }
+
+  /* Output that parent shell has not flushed yet is not ours to write. */
+  __fpurge(stdout);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  resetevents();
+  resetpressure();
+  resetcoprocs();
+  resetzygote();
+  resetjobs();
+
+  defaultsignals();
+  catchinterrupts();
+  Sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+
+  interrupted = false;
+  exit(runscript(fd, true));
+}
+
+/* Without job control jobs share shell's process group, so terminal's
+ * signals reach the foreground job by themselves. Shell only stops the script
+ * on SIGINT, once the job is done. If there's no such job, die of the signal. */
+static void interrupt_handler(int sig)
+{
+  if (sig == SIGINT)
+    interrupted = true;
+  if (!fgjob_p())
+  {
+    Signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+void catchinterrupts(void)
+{
+  Signal(SIGINT, interrupt_handler);
+  Signal(SIGQUIT, interrupt_handler);
+}
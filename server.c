@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <sys/un.h>
+
+#include "shell.h"
+
+/* In server mode the shell listens on a Unix domain socket and runs command
+ * lines on behalf of clients, so they need neither to start a shell nor to
+ * fork one. Each request is a single SOCK_SEQPACKET message carrying client's
+ * standard input, output and error (as SCM_RIGHTS) and a sequence of NUL
+ * terminated strings: working directory (empty if not to be changed),
+ * environment overrides 'NAME=VALUE' and finally the command line. Command
+ * runs in the foreground with client's descriptors, so its output streams
+ * straight back, and then the server replies with exit code as an int. */
+
+#define MAXREQUEST 65536
+#define RECV_TIMEOUT 1 /* [s] client has to send request right after connect */
+
+static volatile sig_atomic_t stopping = false;
+
+static void stop_handler(int sig __unused)
+{
+  stopping = true;
+}
+
+/* Receive request into 'buf', and client's descriptors into 'fds'.
+ * Returns length of request or -1 if it's malformed or doesn't come. */
+static ssize_t recvrequest(int conn, char *buf, int fds[3])
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } cmsg;
+  struct iovec iov = {.iov_base = buf, .iov_len = MAXREQUEST};
+  struct msghdr mh = {.msg_iov = &iov,
+                      .msg_iovlen = 1,
+                      .msg_control = &cmsg,
+                      .msg_controllen = sizeof(cmsg)};
+
+  /* Requests are served one at a time, so an idle client must not hold up
+   * the others for long. */
+  struct timeval tv = {.tv_sec = RECV_TIMEOUT};
+  (void)setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  ssize_t n = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+  if (n < 0)
+  {
+    msg("server: no request: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+      cm->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+  {
+    msg("server: malformed request\n");
+    /* Descriptors we got, if any, would leak. */
+    if (cm && cm->cmsg_type == SCM_RIGHTS)
+      for (int *fdp = (int *)CMSG_DATA(cm);
+           (char *)fdp < (char *)cm + cm->cmsg_len; fdp++)
+        Close(*fdp);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cm), sizeof(int) * 3);
+
+  if ((mh.msg_flags & MSG_TRUNC) || n == 0 || buf[n - 1] != '\0')
+  {
+    msg("server: malformed request\n");
+    for (int i = 0; i < 3; i++)
+      Close(fds[i]);
+    return -1;
+  }
+  return n;
+}
+
+/* Environment variable overridden for the time of a request. */
+typedef struct
+{
+  char *name;
+  char *value; /* previous value or NULL if it was not set */
+} envsave_t;
+
+/* Run command line from request in 'buf' of length 'len' with standard
+ * descriptors replaced by 'fds'. Returns its exit code. */
+static int runrequest(char *buf, ssize_t len, int fds[3])
+{
+  char *end = buf + len;
+  char *cwd = buf;
+  char *cmdline = end - 1;
+
+  /* Command line is the last string. */
+  while (cmdline > buf && cmdline[-1] != '\0')
+    cmdline--;
+
+  int nvars = 0;
+  for (char *s = cwd + strlen(cwd) + 1; s < cmdline; s += strlen(s) + 1)
+    nvars++;
+  envsave_t saved[nvars];
+
+  int exitcode = 0;
+  int dirfd = -1;
+  if (*cwd && cmdline > cwd)
+  {
+    dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (chdir(cwd) < 0)
+    {
+      dprintf(fds[2], "shell: cd: %s: %s\n", strerror(errno), cwd);
+      exitcode = 1;
+    }
+  }
+
+  int i = 0;
+  for (char *s = cwd + strlen(cwd) + 1; s < cmdline; s += strlen(s) + 1)
+  {
+    char *value = index(s, '=');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    char *prev = getenv(s);
+    saved[i++] = (envsave_t){.name = s, .value = prev ? strdup(prev) : NULL};
+    setenv(s, value, 1);
+  }
+  nvars = i;
+
+  int stdfds[3];
+  for (i = 0; i < 3; i++)
+  {
+    stdfds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    Dup2(fds[i], i);
+    Close(fds[i]);
+  }
+
+  if (exitcode == 0 && *cmdline)
+    exitcode = eval(cmdline, false);
+  fflush(stdout);
+
+  for (i = 0; i < 3; i++)
+  {
+    Dup2(stdfds[i], i);
+    Close(stdfds[i]);
+  }
+
+  while (nvars-- > 0)
+  {
+    envsave_t *env = &saved[nvars];
+    if (env->value)
+      setenv(env->name, env->value, 1);
+    else
+      unsetenv(env->name);
+    free(env->value);
+  }
+
+  if (dirfd >= 0)
+  {
+    if (fchdir(dirfd) < 0)
+      msg("server: cannot restore working directory: %s\n", strerror(errno));
+    Close(dirfd);
+  }
+
+  return exitcode;
+}
+
+/* Serve requests one at a time until SIGTERM or SIGINT arrives. */
+void serve(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    app_error("server: socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    unix_error("socket error");
+  (void)unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    unix_error("server: %s", path);
+  if (listen(sock, SOMAXCONN) < 0)
+    unix_error("listen error");
+
+  Signal(SIGTERM, stop_handler);
+  Signal(SIGINT, stop_handler);
+  /* Client may go away while a builtin writes to it. Jobs get SIGPIPE back,
+   * see 'defaultsignals'. */
+  Signal(SIGPIPE, SIG_IGN);
+
+  /* Stop signal must not slip in between the check and going to sleep. */
+  sigset_t block = sigchld_mask;
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGINT);
+
+  char *buf = malloc(MAXREQUEST);
+
+  while (!stopping)
+  {
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &block, &mask);
+    bool ready = !stopping && waitevent(sock, &mask);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    watchjobs(FINISHED, JOBS_SHORT);
+    fflush(stdout);
+    if (!ready)
+      continue;
+
+    int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+      continue;
+
+    int fds[3];
+    ssize_t len = recvrequest(conn, buf, fds);
+    if (len >= 0)
+    {
+      int exitcode = runrequest(buf, len, fds);
+      (void)send(conn, &exitcode, sizeof(exitcode), MSG_NOSIGNAL);
+    }
+    Close(conn);
+  }
+
+  free(buf);
+  Close(sock);
+  (void)unlink(path);
+}
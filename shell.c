@@ -13,6 +13,14 @@ static void sigint_handler(int sig)
   siglongjmp(loop_env, sig);
 }
 
+static bool keep_redir; /* builtin wants its redirections to stay */
+
+/* Called by builtin to keep redirections made for it, see 'exec'. */
+void keepredir(void)
+{
+  keep_redir = true;
+}
+
 /* Rewrite closed file descriptors to -1,
  * to make sure we don't attempt do close them twice. */
 static void MaybeClose(int *fdp)
@@ -24,19 +32,41 @@ static void MaybeClose(int *fdp)
 }
 
 /* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
+ * Put opened file descriptors into inputp & output respectively.
+ * Returns -1 if a file cannot be opened, but consumes the tokens anyway. */
 static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp)
 {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
+  int n = 0; /* number of tokens after redirections are removed */
+  int input = *inputp, output = *outputp; /* not opened here */
+  bool failed = false;
 
   for (int i = 0; i < ntokens; i++)
   {
     // TODO: Handle tokens and open files as requested.
 
-    if (token[i] == T_INPUT)
+    if ((token[i] == T_INPUT || token[i] == T_OUTPUT) &&
+        token[i + 1] == T_BGJOB)
+    {
+      /* '<&NAME' and '>&NAME' use coprocess socket. See 'check_redir'. */
+      int *fdp = token[i] == T_INPUT ? inputp : outputp;
+      *fdp = coprocfd(token[i + 2]);
+
+      token[i] = T_NULL;
+      token[i + 1] = T_NULL;
+      token[i + 2] = T_NULL;
+
+      i += 2;
+    }
+    else if (token[i] == T_INPUT)
     {
-      *inputp = Open(token[i + 1], O_RDONLY, mode);
+      int fd = failed ? -1 : open(token[i + 1], O_RDONLY | O_CLOEXEC);
+      if (fd >= 0)
+        *inputp = fd;
+      else if (!failed)
+      {
+        msg("%s: %s\n", token[i + 1], strerror(errno));
+        failed = true;
+      }
 
       token[i] = T_NULL;
       token[i + 1] = T_NULL;
@@ -45,7 +75,14 @@ static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp)
     }
     else if (token[i] == T_OUTPUT)
     {
-      *outputp = Open(token[i + 1], O_WRONLY, mode);
+      int fd = failed ? -1 : open(token[i + 1], O_WRONLY | O_CLOEXEC);
+      if (fd >= 0)
+        *outputp = fd;
+      else if (!failed)
+      {
+        msg("%s: %s\n", token[i + 1], strerror(errno));
+        failed = true;
+      }
 
       token[i + 1] = T_NULL;
       token[i] = T_NULL;
@@ -59,57 +96,296 @@ static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp)
   }
 
   token[n] = NULL;
+  if (failed)
+  {
+    if (*inputp != input)
+      MaybeClose(inputp);
+    if (*outputp != output)
+      MaybeClose(outputp);
+    return -1;
+  }
+  return n;
+}
+
+/* Returns true if there's a command word apart from redirections. */
+static bool command_p(token_t *token, int ntokens)
+{
+  for (int i = 0; i < ntokens; i++)
+  {
+    if (token[i] == T_INPUT || token[i] == T_OUTPUT)
+      i += token[i + 1] == T_BGJOB ? 2 : 1;
+    else if (string_p(token[i]))
+      return true;
+  }
+  return false;
+}
+
+/* Make sure coprocesses named by redirections exist, before anything
+ * gets started. */
+static bool check_redir(token_t *token, int ntokens)
+{
+  for (int i = 0; i < ntokens; i++)
+  {
+    if ((token[i] != T_INPUT && token[i] != T_OUTPUT) ||
+        token[i + 1] != T_BGJOB)
+      continue;
+    if (!string_p(token[i + 2]))
+    {
+      msg("syntax error: coprocess name expected\n");
+      return false;
+    }
+    if (!coproc_p(token[i + 2]))
+    {
+      msg("%s: no such coprocess\n", token[i + 2]);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Connect standard input & output of a job, unless redirected, to a new
+ * coprocess socket named 'name'. */
+static void do_coproc(const char *name, int *inputp, int *outputp)
+{
+  int fd = mkcoproc(name);
+  if (*inputp < 0)
+    *inputp = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (*outputp < 0)
+    *outputp = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  Close(fd);
+}
+
+/* Without job control background job shares shell's process group, so it
+ * would compete for the terminal. Its input comes from /dev/null instead,
+ * unless redirected. */
+static void detachinput(int *inputp)
+{
+  if (*inputp < 0 && !jobcontrol_p())
+    *inputp = Open("/dev/null", O_RDONLY | O_CLOEXEC, 0);
+}
+
+/* Modifiers that precede a command line. */
+typedef struct
+{
+  char *coproc;    /* 'coproc NAME': run job as coprocess called so */
+  bool timed;      /* 'time': report resource usage when the job finishes */
+  long timeout;    /* 'timeout duration': [ms] terminate job after, 0 if off */
+  limits_t limits; /* 'limit key=value ... --': confine job's processes */
+  bool exec;       /* nothing follows, so external command may replace shell */
+} jobopts_t;
+
+/* Parse number of seconds with optional s, m or h suffix as timeout(1) does. */
+static bool parseduration(const char *s, long *msecp)
+{
+  char *end;
+  double secs = strtod(s, &end);
+
+  if (end == s || secs <= 0)
+    return false;
+  switch (*end)
+  {
+    case 'h':
+      secs *= 60;
+      /* FALLTHROUGH */
+    case 'm':
+      secs *= 60;
+      /* FALLTHROUGH */
+    case 's':
+      end++;
+  }
+  *msecp = secs * 1000;
+  return *end == '\0' && *msecp > 0;
+}
+
+/* Consume leading job modifiers. Returns number of tokens consumed,
+ * or -1 if modifiers are malformed. */
+static int do_modifiers(token_t *token, int ntokens, jobopts_t *opts)
+{
+  int n = 0;
+
+  while (n < ntokens - 1 && string_p(token[n]))
+  {
+    if (!strcmp(token[n], "time"))
+    {
+      opts->timed = true;
+      n++;
+    }
+    else if (!strcmp(token[n], "limit"))
+    {
+      for (n++; n < ntokens && string_p(token[n]) && index(token[n], '='); n++)
+      {
+        if (!parselimit(&opts->limits, token[n]))
+        {
+          msg("limit: invalid limit: %s\n", token[n]);
+          return -1;
+        }
+      }
+      if (n < ntokens && string_p(token[n]) && !strcmp(token[n], "--"))
+        n++;
+    }
+    else if (!strcmp(token[n], "coproc") && n < ntokens - 2 &&
+             string_p(token[n + 1]) && coprocname_p(token[n + 1]))
+    {
+      /* Otherwise it's 'coproc' builtin. */
+      opts->coproc = token[n + 1];
+      n += 2;
+    }
+    else if (!strcmp(token[n], "timeout"))
+    {
+      n++;
+      if (!string_p(token[n]) || !parseduration(token[n], &opts->timeout))
+      {
+        msg("timeout: invalid duration: %s\n",
+            string_p(token[n]) ? token[n] : "");
+        return -1;
+      }
+      n++;
+    }
+    else
+    {
+      break;
+    }
+  }
+
   return n;
 }
 
 /* Execute internal command within shell's process or execute external command
  * in a subprocess. External command can be run in the background. */
-static int do_job(token_t *token, int ntokens, bool bg)
+static int do_job(token_t *token, int ntokens, bool bg, jobopts_t *opts)
 {
   int input = -1, output = -1;
   int exitcode = 0;
 
   ntokens = do_redir(token, ntokens, &input, &output);
+  if (ntokens < 0)
+    return 1;
+  if (opts->coproc)
+    do_coproc(opts->coproc, &input, &output);
+  if (bg)
+    detachinput(&input);
 
   if (!bg)
   {
-    if ((exitcode = builtin_command(token)) >= 0)
+    /* Builtins run within shell's process, so redirect its own standard
+     * input & output for the time being. */
+    int saved_input = -1, saved_output = -1;
+    if (input != -1)
+    {
+      saved_input = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+      Dup2(input, STDIN_FILENO);
+    }
+    if (output != -1)
+    {
+      saved_output = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+      Dup2(output, STDOUT_FILENO);
+    }
+
+    keep_redir = false;
+    exitcode = builtin_command(token);
+
+    if (keep_redir)
+    {
+      MaybeClose(&saved_input);
+      MaybeClose(&saved_output);
+    }
+    if (saved_input != -1)
+    {
+      Dup2(saved_input, STDIN_FILENO);
+      MaybeClose(&saved_input);
+    }
+    if (saved_output != -1)
+    {
+      fflush(stdout);
+      Dup2(saved_output, STDOUT_FILENO);
+      MaybeClose(&saved_output);
+    }
+
+    if (exitcode >= 0)
+    {
+      MaybeClose(&input);
+      MaybeClose(&output);
       return exitcode;
+    }
+
+    /* Last command of a script needs neither fork nor monitoring. */
+    if (opts->exec && !opts->timed && !opts->timeout && !opts->coproc)
+    {
+      fflush(stdout);
+      if (input != -1)
+      {
+        Dup2(input, STDIN_FILENO);
+        MaybeClose(&input);
+      }
+      if (output != -1)
+      {
+        Dup2(output, STDOUT_FILENO);
+        MaybeClose(&output);
+      }
+      applylimits(&opts->limits);
+      defaultsignals();
+      external_command(token);
+    }
   }
 
+  /* Background job must take a jobserver token before it starts. Foreground
+   * job runs on behalf of the shell, which holds an implicit token. */
+  char jstoken;
+  if (bg)
+    admitjob();
+  bool hastoken = bg && gettoken(&jstoken, true) > 0;
+
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
   // TODO: Start a subprocess, create a job and monitor it. */
 
-  pid_t child_pid = Fork();
+  pid_t child_pid = spawnproc(0, bg, input, output, &opts->limits, token);
+  if (child_pid < 0)
+    child_pid = Fork();
   size_t job_index;
 
   if (child_pid == 0)
   {
     Sigprocmask(SIG_SETMASK, &mask, NULL);
-    Setpgid(0, 0);
-    Signal(SIGTSTP, SIG_DFL);
+    joinjob(0, bg);
+    defaultsignals();
 
     if (input != -1)
     {
       Dup2(input, STDIN_FILENO);
+      MaybeClose(&input);
     }
     if (output != -1)
     {
       Dup2(output, STDOUT_FILENO);
+      MaybeClose(&output);
     }
+    applylimits(&opts->limits);
     external_command(token);
   }
   else
   {
+    /* Job may get signalled before the child gets to run, so the parent
+     * moves it to its own group too. See 'do_stage'. */
+    if (jobcontrol_p())
+      (void)setpgid(child_pid, child_pid);
     job_index = addjob(child_pid, bg);
+    MaybeClose(&input);
+    MaybeClose(&output);
     addproc(job_index, child_pid, token);
+    limitproc(job_index, &opts->limits);
+    if (hastoken)
+      tokenjob(job_index, &jstoken, 1);
+    if (opts->timed)
+      timejob(job_index);
+    if (opts->timeout)
+      timeoutjob(job_index, opts->timeout);
 
     if (bg == FG)
     {
-      monitorjob(&mask);
-        }
+      exitcode = monitorjob(&mask);
+    }
   }
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
@@ -117,40 +393,56 @@ static int do_job(token_t *token, int ntokens, bool bg)
 }
 
 /* Start internal or external command in a subprocess that belongs to pipeline.
- * All subprocesses in pipeline must belong to the same process group. */
-static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens)
+ * All subprocesses in pipeline must belong to the same process group.
+ * Limits of the stage are stored under 'limits'. */
+static pid_t do_stage(pid_t pgid, bool bg, sigset_t *mask, int input,
+                      int output, token_t *token, int ntokens, limits_t *limits)
 {
-  ntokens = do_redir(token, ntokens, &input, &output);
-
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+  /* Stage that cannot be redirected still runs, so that the pipeline stays
+   * whole, and fails right away. 'do_pipeline' rejects empty ones. */
+  bool failed = do_redir(token, ntokens, &input, &output) < 0;
+  assert(token[0] != NULL);
 
   // TODO: Start a subprocess and make sure it's moved to a process group. */
 
-  pid_t pid = Fork();
-  size_t job_index;
+  pid_t pid = -1;
+  if (!failed && !builtin_p(token[0]))
+    pid = spawnproc(pgid, bg, input, output, limits, token);
+  if (pid < 0)
+    pid = Fork();
 
   if (pid == 0)
   {
-    Sigprocmask(SIG_SETMASK, &mask, NULL);
-    Setpgid(0, pgid);
-    Signal(SIGTSTP, SIG_DFL);
+    Sigprocmask(SIG_SETMASK, mask, NULL);
+    joinjob(pgid, bg);
+    defaultsignals();
+    if (failed)
+      exit(EXIT_FAILURE);
     if (input != -1)
     {
       Dup2(input, STDIN_FILENO);
+      MaybeClose(&input);
     }
     if (output != -1)
     {
       Dup2(output, STDOUT_FILENO);
+      MaybeClose(&output);
+    }
+    applylimits(limits);
+
+    int exitcode = builtin_command(token);
+    if (exitcode >= 0)
+    {
+      fflush(stdout);
+      exit(exitcode);
     }
-    token[ntokens] = T_NULL;
     external_command(token);
   }
-  else
-  {
-  }
 
+  /* Parent moves the child as well, so the group exists for next stages.
+   * This fails harmlessly if the child has already done it and called execve. */
+  if (jobcontrol_p())
+    (void)setpgid(pid, pgid);
   return pid;
 }
 
@@ -166,15 +458,42 @@ static void mkpipe(int *readp, int *writep)
 
 /* Pipeline execution creates a multiprocess job. Both internal and external
  * commands are executed in subprocesses. */
-static int do_pipeline(token_t *token, int ntokens, bool bg)
+static int do_pipeline(token_t *token, int ntokens, bool bg, jobopts_t *opts)
 {
   pid_t pid, pgid = 0;
   int job = -1;
   int exitcode = 0;
 
-  int input = -1, output = -1, next_input = -1;
+  int input = -1, output = -1, next_input = -1, last_output = -1;
 
-  mkpipe(&next_input, &output);
+  /* Check modifiers and commands of all stages before anything gets
+   * started. */
+  for (int start = 0, end; start < ntokens; start = end + 1)
+  {
+    for (end = start; end < ntokens && token[end] != T_PIPE; end++)
+      continue;
+
+    int n = 0;
+    jobopts_t stage = *opts;
+    if (start > 0 && (n = do_modifiers(&token[start], end - start, &stage)) < 0)
+      return 1;
+    if (!command_p(&token[start + n], end - start - n))
+    {
+      msg("syntax error: command expected\n");
+      return 1;
+    }
+  }
+
+  char jstoken;
+  if (bg)
+    admitjob();
+  bool hastoken = bg && gettoken(&jstoken, true) > 0;
+
+  /* Coprocess reads with the first stage and writes with the last one. */
+  if (opts->coproc)
+    do_coproc(opts->coproc, &input, &last_output);
+  if (bg)
+    detachinput(&input);
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
@@ -182,50 +501,49 @@ static int do_pipeline(token_t *token, int ntokens, bool bg)
   // TODO: Start pipeline subprocesses, create a job and monitor it.
   // Remember to close unused pipe ends! */
 
-  int number_of_segments = 1;
-  for (int i = 0; i < ntokens; i++)
+  for (int start = 0, end; start < ntokens; start = end + 1)
   {
-    if (token[i] == T_PIPE)
-      number_of_segments++;
-  }
-  int stage_length = 0;
+    for (end = start; end < ntokens && token[end] != T_PIPE; end++)
+      continue;
 
-  int now = ntokens - 1;
+    if (end < ntokens)
+      mkpipe(&next_input, &output);
+    else
+      output = last_output;
 
-  for (int i = ntokens - 1; i > 0; i--)
-  {
-    if (token[i] == T_PIPE)
-      break;
-    stage_length++;
-  }
-  pid = do_stage(pgid, &mask, input, output, token[now], stage_length);
-  mkpipe(&next_input, &output);
+    /* Modifiers in front of a stage other than the first apply only to it,
+     * on top of the ones in front of the whole pipeline. */
+    int n = 0;
+    jobopts_t stage = *opts;
+    if (start > 0)
+      n = do_modifiers(&token[start], end - start, &stage);
 
-  now = ntokens - stage_length;
-  for (size_t i = number_of_segments - 1; i > 1; i--)
-  {
-    now = now - stage_length;
-    stage_length = 0;
+    pid = do_stage(pgid, bg, &mask, input, output, &token[start + n],
+                   end - start - n, &stage.limits);
 
-    for (int j = now; j > 0; j--)
+    if (pgid == 0)
     {
-      if (token[j] == T_PIPE)
-        break;
-      stage_length++;
+      pgid = pid;
+      job = addjob(pgid, bg);
     }
-    now = now - stage_length + 1;
-  }
-  stage_length = 0;
-  for (int j = 0; j < now; j++)
-  {
-    if (token[j] == T_PIPE)
-      break;
-    stage_length++;
+    addproc(job, pid, &token[start + n]);
+    limitproc(job, &stage.limits);
+
+    MaybeClose(&input);
+    MaybeClose(&output);
+    input = next_input;
+    next_input = -1;
   }
-  now = now - stage_length + 1;
-  input = next_input;
-  output = -1;
-  pid = do_stage(pgid, &mask, input, output, token[now], stage_length);
+
+  if (hastoken)
+    tokenjob(job, &jstoken, 1);
+  if (opts->timed)
+    timejob(job);
+  if (opts->timeout)
+    timeoutjob(job, opts->timeout);
+
+  if (!bg)
+    exitcode = monitorjob(&mask);
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
@@ -239,11 +557,16 @@ static bool is_pipeline(token_t *token, int ntokens)
   return false;
 }
 
-static void eval(char *cmdline)
+/* Evaluate command line. Job is run in background if the line ends with '&'
+ * or 'bg' is set. If 'last' is set, simple external command in foreground
+ * replaces the shell. Returns exit code of foreground job. */
+static int do_eval(char *cmdline, bool bg, bool last)
 {
-  bool bg = false;
+  int exitcode = 0;
   int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+  token_t *tokens = tokenize(cmdline, &ntokens);
+  token_t *token = tokens;
+  jobopts_t opts = {.exec = last};
 
   if (ntokens > 0 && token[ntokens - 1] == T_BGJOB)
   {
@@ -251,46 +574,178 @@ static void eval(char *cmdline)
     bg = true;
   }
 
+  int n = do_modifiers(token, ntokens, &opts);
+  if (n < 0 || !check_redir(token, ntokens))
+  {
+    ntokens = 0;
+    exitcode = 1;
+  }
+  else
+  {
+    token += n;
+    ntokens -= n;
+  }
+
+  /* Coprocess runs in the background while the shell talks to it. */
+  if (opts.coproc)
+    bg = true;
+
   if (ntokens > 0)
   {
     if (is_pipeline(token, ntokens))
     {
-      do_pipeline(token, ntokens, bg);
+      exitcode = do_pipeline(token, ntokens, bg, &opts);
     }
     else
     {
-      do_job(token, ntokens, bg);
+      exitcode = do_job(token, ntokens, bg, &opts);
+    }
+  }
+
+  free(tokens);
+  return exitcode;
+}
+
+int eval(char *cmdline, bool bg)
+{
+  return do_eval(cmdline, bg, false);
+}
+
+/* Evaluate command line that is the last thing the shell does. Simple
+ * external command then replaces the shell rather than being forked. */
+int evallast(char *cmdline)
+{
+  return do_eval(cmdline, false, true);
+}
+
+/* Let readline sleep in the event loop, so that timers are served
+ * while the shell waits for user input. */
+static char *input_line; /* line read at the prompt or NULL on end of file */
+static bool input_ready; /* readline has finished reading a line */
+
+static void line_handler(char *line)
+{
+  input_line = line;
+  input_ready = true;
+  rl_callback_handler_remove();
+}
+
+/* Read a command line, while serving events. Background jobs that finish in
+ * the meantime are reported right away and the prompt is redrawn. */
+static char *readcmd(const char *prompt)
+{
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  input_ready = false;
+  rl_callback_handler_install(prompt, line_handler);
+
+  while (!input_ready)
+  {
+    if (waitevent(fileno(rl_instream), &mask))
+    {
+      rl_callback_read_char();
+    }
+    else if (finished_p())
+    {
+      rl_clear_visible_line();
+      watchjobs(FINISHED, JOBS_SHORT);
+      fflush(stdout);
+      rl_forced_update_display();
     }
   }
 
-  free(token);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return input_line;
 }
 
 int main(int argc, char *argv[])
 {
-  rl_initialize();
+  const char *server = NULL;  /* socket path in server mode */
+  const char *command = NULL; /* commands given with '-c' */
+  bool zygote = false;        /* spawn external commands through zygote */
+  int opt;
+
+  /* Options end at script's name. */
+  while ((opt = getopt(argc, argv, "+c:s:z")) != -1)
+  {
+    if (opt == 'c')
+      command = optarg;
+    else if (opt == 's')
+      server = optarg;
+    else if (opt == 'z')
+      zygote = true;
+    else
+    {
+      msg("usage: %s [-z] [-s socket | -c commands | script]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const char *script = optind < argc ? argv[optind] : NULL;
+  bool interactive = !server && !command && !script && isatty(STDIN_FILENO);
+
+  int script_fd = STDIN_FILENO;
+  if (script && (script_fd = open(script, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    msg("%s: %s: %s\n", argv[0], script, strerror(errno));
+    return 127;
+  }
 
   sigemptyset(&sigchld_mask);
   sigaddset(&sigchld_mask, SIGCHLD);
 
-  Setpgid(0, 0);
+  /* Without job control the shell stays in group it was started in. */
+  if (interactive || server)
+    Setpgid(0, 0);
+
+  /* Zygote has to be forked while the shell is still small. */
+  if (zygote)
+    initzygote();
 
-  initjobs();
+  /* Only interactive shell takes the terminal and uses readline. */
+  initjobs(interactive);
+  initjobserver();
 
+  /* Without job control the shell stops along with its foreground job,
+   * which is in its group. */
+  if (interactive)
+    ignorestops();
+
+  if (server)
+  {
+    serve(server);
+    shutdownjobs(SHUTDOWN_GRACE);
+    return 0;
+  }
+
+  if (!interactive)
+  {
+    /* Builtins write through stdio, and their lines must not come out after
+     * output of commands that follow them, when stdout is not a terminal. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    catchinterrupts();
+    int exitcode = command ? runstring(command) : runscript(script_fd, true);
+    /* Background jobs left running by the script are none of our business. */
+    return exitcode;
+  }
+
+  rl_initialize();
   Signal(SIGINT, sigint_handler);
-  Signal(SIGTSTP, SIG_IGN);
-  Signal(SIGTTIN, SIG_IGN);
-  Signal(SIGTTOU, SIG_IGN);
 
   char *line;
   while (true)
   {
     if (!sigsetjmp(loop_env, 1))
     {
-      line = readline("# ");
+      line = readcmd("# ");
     }
     else
     {
+      /* Abandon the line being edited, if any. */
+      rl_free_line_state();
+      rl_callback_sigcleanup();
+      rl_callback_handler_remove();
       msg("\n");
       continue;
     }
@@ -301,14 +756,14 @@ int main(int argc, char *argv[])
     if (strlen(line))
     {
       add_history(line);
-      eval(line);
+      eval(line, false);
     }
     free(line);
-    watchjobs(FINISHED);
+    watchjobs(FINISHED, JOBS_SHORT);
   }
 
   msg("\n");
-  shutdownjobs();
+  shutdownjobs(SHUTDOWN_GRACE);
 
   return 0;
 }
@@ -1,7 +1,10 @@
 #ifndef _SHELL_H_
 #define _SHELL_H_
 
+#include <sys/resource.h>
+
 #include "csapp.h"
+#include "bitstring.h"
 
 #define msg(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 
@@ -43,19 +46,126 @@ enum {
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
-void shutdownjobs(void);
+/* Formats of job reports. */
+enum {
+  JOBS_SHORT = 0, /* job number, state and command */
+  JOBS_LONG = 1,  /* ... followed by state and resource usage of processes */
+  JOBS_PGIDS = 2, /* process group identifiers only */
+  JOBS_JSON = 3,  /* array of objects with state of jobs and processes */
+};
+
+#define MAXCPUS 1024
+
+/* Resource limits, CPU affinity and priority of processes, set up by 'limit'
+ * job modifier. Zeroed structure does not change anything. */
+typedef struct
+{
+  rlim_t mem;                       /* address space limit in bytes */
+  rlim_t cputime;                   /* CPU time limit in seconds */
+  rlim_t nofile;                    /* limit on number of open files */
+  bool renice;                      /* set nice value of processes */
+  int nice;                         /* ... to this value */
+  bool affinity;                    /* restrict processes to CPUs */
+  bitstr_t bit_decl(cpus, MAXCPUS); /* ... from this set */
+} limits_t;
+
+void initjobs(bool interactive);
+void ignorestops(void);
+void defaultsignals(void);
+#define SHUTDOWN_GRACE 2000 /* [ms] jobs have to finish when shell exits */
+
+void shutdownjobs(long grace);
+void resetjobs(void);
 
 int addjob(pid_t pgid, int bg);
+int lastjob(void);
 void addproc(int job, pid_t pid, char **argv);
+typedef pid_t (*chunkfunc_t)(pid_t pgid, int chunk, void *arg);
+
+void gatejob(int job, int fd, int nchunks, int nparallel, chunkfunc_t func,
+             void *arg);
+void tokenjob(int job, const char *tokens, int n);
+void timejob(int job);
+void timeoutjob(int job, long msec);
+void limitproc(int job, const limits_t *limits);
 bool killjob(int job);
-void watchjobs(int state);
+bool throttlejob(int job, int percent);
+void subreaperjobs(bool enable);
+bool subreaper_p(void);
+void tagproc(void);
+void tagjob(pid_t pgid);
+bool jobcontrol_p(void);
+void joinjob(pid_t pgid, bool bg);
+void watchjobs(int state, int format);
+bool finished_p(void);
+bool jobs_p(void);
 int jobstate(int job, int *exitcodep);
 char *jobcmd(int job);
+int findjob(const char *spec);
 bool resumejob(int job, int bg, sigset_t *mask);
+int pausejob(void);
+bool unpausejob(sigset_t *mask);
+void waitjobs(const int *js, int n, sigset_t *mask);
+int waitjob(int job, int *exitcodep, sigset_t *mask);
 int monitorjob(sigset_t *mask);
+bool fgjob_p(void);
+
+typedef void (*evfunc_t)(int fd, void *arg);
+
+void addevent(int fd, evfunc_t func, void *arg);
+void delevent(int fd);
+int addtimer(long msec, bool periodic, evfunc_t func, void *arg);
+void settimer(int fd, long msec, bool periodic);
+void deltimer(int fd);
+void resetevents(void);
+bool waitevents(const int *fds, int nfds, const sigset_t *mask);
+bool waitevent(int fd, const sigset_t *mask);
+
+bool setpressure(const char *name, double limit);
+void pausepressure(bool enable);
+void showpressure(void);
+void resetpressure(void);
+void admitjob(void);
+bool parselimit(limits_t *limits, char *spec);
+void applylimits(const limits_t *limits);
+void showlimits(FILE *out, const limits_t *limits);
+void setbgnice(int incr, bool idleio);
+void showbgnice(void);
+int getioprio(void);
+bool demoteprio(pid_t id, bool group, int nice, int ioprio);
+void restoreprio(pid_t id, bool group, int nice, int ioprio);
+
+void initjobserver(void);
+void mkjobserver(int n);
+bool jobserver_p(void);
+int gettoken(char *tokp, bool block);
+void puttokens(const char *tokens, int n);
+
+bool coprocname_p(const char *name);
+bool coproc_p(const char *name);
+int mkcoproc(const char *name);
+int coprocfd(const char *name);
+bool closecoproc(const char *name);
+void showcoprocs(void);
+void resetcoprocs(void);
+
+void serve(const char *path);
+
+int runscript(int fd, bool tailcall);
+int runstring(const char *text);
+void catchinterrupts(void);
+noreturn void runfile(const char *path);
+
+void initzygote(void);
+void resetzygote(void);
+pid_t spawnproc(pid_t pgid, bool bg, int input, int output,
+                const limits_t *limits, char **argv);
 
+int eval(char *cmdline, bool bg);
+int evallast(char *cmdline);
+void keepredir(void);
 int builtin_command(char **argv);
+bool builtin_p(const char *name);
 noreturn void external_command(char **argv);
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
@@ -0,0 +1,121 @@
+#include <sys/un.h>
+
+#include "csapp.h"
+
+/* Client of shell's server mode. Sends a command line with current working
+ * directory and environment overrides, lets the server use our standard
+ * input, output & error, and exits with command's exit code. See 'server.c'.
+ *
+ * Usage: shellc [-C dir] [-e NAME=VALUE]... socket command [args...] */
+
+#define MAXREQUEST 65536
+
+static noreturn void usage(const char *prog)
+{
+  dprintf(STDERR_FILENO,
+          "usage: %s [-C dir] [-e NAME=VALUE]... socket command [args...]\n",
+          prog);
+  exit(2);
+}
+
+/* Append NUL terminated string to request. */
+static void append(char *buf, size_t *lenp, const char *s)
+{
+  size_t n = strlen(s) + 1;
+  if (*lenp + n > MAXREQUEST)
+    app_error("shellc: request too long");
+  memcpy(buf + *lenp, s, n);
+  *lenp += n;
+}
+
+int main(int argc, char *argv[])
+{
+  static char buf[MAXREQUEST];
+  size_t len = 0;
+  char *cwd = NULL;
+  int opt;
+
+  /* Environment overrides go after working directory, so collect them. */
+  char *vars[argc];
+  int nvars = 0;
+
+  while ((opt = getopt(argc, argv, "+C:e:")) != -1)
+  {
+    if (opt == 'C')
+      cwd = optarg;
+    else if (opt == 'e' && index(optarg, '='))
+      vars[nvars++] = optarg;
+    else
+      usage(argv[0]);
+  }
+  if (argc - optind < 2)
+    usage(argv[0]);
+
+  const char *path = argv[optind++];
+
+  if (cwd)
+  {
+    append(buf, &len, cwd);
+  }
+  else
+  {
+    char *here = getcwd(NULL, 0);
+    append(buf, &len, here ? here : "");
+    free(here);
+  }
+  for (int i = 0; i < nvars; i++)
+    append(buf, &len, vars[i]);
+
+  /* Shell's lexer splits words on spaces only, so just join them. */
+  for (int i = optind; i < argc; i++)
+  {
+    size_t n = strlen(argv[i]);
+    if (len + n + 1 > MAXREQUEST)
+      app_error("shellc: request too long");
+    memcpy(buf + len, argv[i], n);
+    len += n;
+    buf[len++] = i + 1 < argc ? ' ' : '\0';
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    app_error("shellc: socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    unix_error("socket error");
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    unix_error("shellc: %s", path);
+
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } cmsg;
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr mh = {.msg_iov = &iov,
+                      .msg_iovlen = 1,
+                      .msg_control = &cmsg,
+                      .msg_controllen = sizeof(cmsg)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+  memcpy(CMSG_DATA(cm), (int[]){STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO},
+         sizeof(int) * 3);
+
+  if (sendmsg(sock, &mh, 0) < 0)
+    unix_error("sendmsg error");
+
+  int exitcode;
+  ssize_t n;
+  while ((n = recv(sock, &exitcode, sizeof(exitcode), 0)) < 0 && errno == EINTR)
+    continue;
+  if (n != sizeof(exitcode))
+  {
+    dprintf(STDERR_FILENO, "shellc: no reply from server\n");
+    return 255;
+  }
+  return exitcode;
+}
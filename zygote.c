@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "shell.h"
+
+/* Fork gets slower as shell's address space grows, since page tables of
+ * history, job table and readline's buffers have to be copied. Zygote is a
+ * small process forked at startup, before any of those exist, that forks
+ * and executes external commands on shell's behalf. Its children are created
+ * with CLONE_PARENT, so they are shell's children: SIGCHLD, waiting and
+ * process groups work exactly as if the shell had forked them.
+ *
+ * Round trip to the zygote costs about as much as a fork of a shell with a
+ * few MiB resident, so '-z' pays off once the shell has grown past that,
+ * see bench/spawn.c.
+ *
+ * Spawn request is a single SOCK_SEQPACKET message with spawn_t header,
+ * 'argc' NUL terminated words and environment changes since the zygote was
+ * started: '+NAME=VALUE' or '-NAME'. Child's standard input, output & error
+ * and shell's working directory (an O_PATH descriptor) are attached as
+ * SCM_RIGHTS. Zygote replies with child's pid or -1. */
+
+#define MAXSPAWN 65536
+#define NSPAWNFDS 4 /* stdin, stdout, stderr, working directory */
+
+typedef struct
+{
+  pid_t pgid;      /* process group to join, 0 to create own one */
+  pid_t job;       /* job to tag the process with, 0 if it's the first one */
+  bool bg;         /* background job without job control ignores ^C */
+  int argc;        /* number of words */
+  bool tagged;     /* subreaper mode is on, so tag the process */
+  limits_t limits; /* see 'applylimits' */
+} spawn_t;
+
+static int zygote_fd = -1; /* shell's end of socket, -1 if there's none */
+static char **zygote_env;  /* environment the zygote has got */
+static int zygote_nenv;    /* number of its variables */
+
+static noreturn void zygote(int sock)
+{
+  char *buf = malloc(MAXSPAWN);
+
+  /* Stay out of shell's process group, so ^C at prompt doesn't kill us. */
+  Setpgid(0, 0);
+
+  while (true)
+  {
+    union
+    {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int) * NSPAWNFDS)];
+    } cmsg;
+    struct iovec iov = {.iov_base = buf, .iov_len = MAXSPAWN};
+    struct msghdr mh = {.msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = &cmsg,
+                        .msg_controllen = sizeof(cmsg)};
+
+    ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+      continue;
+    /* Shell is gone. */
+    if (n <= 0)
+      exit(EXIT_SUCCESS);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    assert(cm && cm->cmsg_len == CMSG_LEN(sizeof(int) * NSPAWNFDS));
+    int fds[NSPAWNFDS];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    spawn_t *req = (spawn_t *)buf;
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+
+    if (pid == 0)
+    {
+      Setpgid(0, req->pgid);
+      defaultsignals();
+      if (req->bg)
+      {
+        Signal(SIGINT, SIG_IGN);
+        Signal(SIGQUIT, SIG_IGN);
+      }
+      for (int i = 0; i < 3; i++)
+        Dup2(fds[i], i);
+      if (fchdir(fds[3]) < 0)
+        unix_error("fchdir error");
+
+      char **argv = alloca(sizeof(char *) * (req->argc + 1));
+      char *s = buf + sizeof(spawn_t);
+      for (int i = 0; i < req->argc; i++, s += strlen(s) + 1)
+        argv[i] = s;
+      argv[req->argc] = NULL;
+
+      for (; s < buf + n; s += strlen(s) + 1)
+      {
+        if (*s == '+')
+          putenv(s + 1);
+        else
+          unsetenv(s + 1);
+      }
+
+      applylimits(&req->limits);
+      if (req->tagged)
+        tagjob(req->job ? req->job : getpid());
+      external_command(argv);
+    }
+
+    for (int i = 0; i < NSPAWNFDS; i++)
+      Close(fds[i]);
+    (void)send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+  }
+}
+
+/* Start zygote. Must be called before shell allocates anything big. */
+void initzygote(void)
+{
+  int sv[2];
+  Socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+
+  /* Remember what environment the zygote starts with. */
+  while (environ[zygote_nenv])
+    zygote_nenv++;
+  zygote_env = malloc(sizeof(char *) * zygote_nenv);
+  for (int i = 0; i < zygote_nenv; i++)
+    zygote_env[i] = strdup(environ[i]);
+
+  if (Fork() == 0)
+  {
+    Close(sv[0]);
+    zygote(sv[1]);
+  }
+
+  Close(sv[1]);
+  zygote_fd = sv[0];
+}
+
+/* Children of zygote become children of the shell that started it, so
+ * a child process of the shell must fork by itself. */
+void resetzygote(void)
+{
+  if (zygote_fd < 0)
+    return;
+  Close(zygote_fd);
+  zygote_fd = -1;
+}
+
+/* Append string 's' with 'prefix' to request. */
+static bool append(char *buf, size_t *lenp, const char *prefix, const char *s)
+{
+  size_t p = strlen(prefix), n = strlen(s) + 1;
+  if (*lenp + p + n > MAXSPAWN)
+    return false;
+  memcpy(buf + *lenp, prefix, p);
+  memcpy(buf + *lenp + p, s, n);
+  *lenp += p + n;
+  return true;
+}
+
+static bool inenv(char **env, int nenv, const char *var)
+{
+  for (int i = 0; i < nenv; i++)
+    if (!strcmp(env[i], var))
+      return true;
+  return false;
+}
+
+/* Describe how current environment differs from zygote's one. */
+static bool envdelta(char *buf, size_t *lenp)
+{
+  int nenv = 0;
+  while (environ[nenv])
+    nenv++;
+
+  for (int i = 0; i < nenv; i++)
+    if (!inenv(zygote_env, zygote_nenv, environ[i]) &&
+        !append(buf, lenp, "+", environ[i]))
+      return false;
+
+  for (int i = 0; i < zygote_nenv; i++)
+  {
+    char *var = zygote_env[i];
+    size_t len = strcspn(var, "=");
+    char name[len + 1];
+    memcpy(name, var, len);
+    name[len] = '\0';
+    if (!getenv(name) && !append(buf, lenp, "-", name))
+      return false;
+  }
+  return true;
+}
+
+/* Let zygote start external command 'argv' as part of job 'pgid' (or a new
+ * job if 0, see 'joinjob') with standard input & output replaced by 'input'
+ * & 'output' unless they're negative. Returns child's pid, or -1 if there's
+ * no zygote or the request doesn't fit, so the caller has to fork by itself. */
+pid_t spawnproc(pid_t pgid, bool bg, int input, int output,
+                const limits_t *limits, char **argv)
+{
+  if (zygote_fd < 0)
+    return -1;
+
+  static char *buf = NULL;
+  if (!buf)
+    buf = malloc(MAXSPAWN);
+  spawn_t *req = (spawn_t *)buf;
+  /* Zygote has left shell's group, so the child has to join it explicitly
+   * when there's no job control. */
+  bool jc = jobcontrol_p();
+  *req = (spawn_t){.pgid = jc ? pgid : getpgrp(),
+                   .job = pgid,
+                   .bg = bg && !jc,
+                   .tagged = subreaper_p(),
+                   .limits = *limits};
+  size_t len = sizeof(spawn_t);
+
+  for (; argv[req->argc]; req->argc++)
+    if (!append(buf, &len, "", argv[req->argc]))
+      return -1;
+  if (!envdelta(buf, &len))
+    return -1;
+
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * NSPAWNFDS)];
+  } cmsg;
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr mh = {.msg_iov = &iov,
+                      .msg_iovlen = 1,
+                      .msg_control = &cmsg,
+                      .msg_controllen = sizeof(cmsg)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * NSPAWNFDS);
+
+  /* Shell may have changed directory since the zygote was started. */
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd < 0)
+    return -1;
+  int fds[NSPAWNFDS] = {input >= 0 ? input : STDIN_FILENO,
+                        output >= 0 ? output : STDOUT_FILENO, STDERR_FILENO,
+                        cwd};
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+  pid_t pid = -1;
+  ssize_t n = sendmsg(zygote_fd, &mh, MSG_NOSIGNAL);
+  Close(cwd);
+  if (n < 0 && errno == EMSGSIZE)
+    return -1;
+  if (n >= 0)
+  {
+    while ((n = recv(zygote_fd, &pid, sizeof(pid), 0)) < 0 && errno == EINTR)
+      continue;
+  }
+  if (n <= 0)
+  {
+    /* Zygote has died. Fork by ourselves from now on. */
+    msg("zygote: %s\n", n < 0 ? strerror(errno) : "exited");
+    Close(zygote_fd);
+    zygote_fd = -1;
+    return -1;
+  }
+  return pid;
+}